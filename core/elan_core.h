@@ -0,0 +1,761 @@
+/*
+ * Frame assembly and ghost release filter of the ELAN1200 touchpad,
+ * shared by the kernel module and the userspace driver.
+ *
+ * The core has no dependencies and doesn't allocate, a driver supplies
+ * the clock, the timers and the output with struct elan_core_ops. The
+ * calls for one device are serialised by the driver.
+ */
+
+#ifndef ELAN_CORE_H
+#define ELAN_CORE_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/compiler.h>
+#include <linux/string.h>
+#include <linux/math64.h>
+#define ELAN_READ_ONCE(x) READ_ONCE(x)
+#define elan_ns_to_us(ns) div_u64(ns, 1000)
+#define elan_div_s64(a, b) div_s64(a, b)
+#else
+#include <stdint.h>
+#include <string.h>
+#define ELAN_READ_ONCE(x) (*(volatile __typeof__(x) *)&(x))
+#define elan_ns_to_us(ns) ((ns) / 1000)
+#define elan_div_s64(a, b) ((int64_t)(a) / (b))
+#endif
+
+
+#define ELAN_REPORT_ID 0x04
+#define ELAN_REPORT_SIZE 14
+
+#define ELAN_MAX_CONTACTS 5
+#define ELAN_MAX_SCANTIME ((255 << 8) | 255)
+#define ELAN_MAX_TIMESTAMP_INTERVAL 1000000
+
+// on my machine 14 ms is minimum, otherwise
+// the delayed state is reported earlier than the next event arrives,
+// it's used until enough re-touch gaps are observed
+#define ELAN_DELAY_USEC 17000
+
+// the delay is learnt from the observed gaps between a release
+// and the re-touch which follows it when the release is a ghost one
+#define ELAN_DELAY_PERCENTILE 99
+#define ELAN_DELAY_MIN_USEC 6000
+#define ELAN_DELAY_MAX_USEC 32000
+#define ELAN_GAP_BUCKET_USEC 250
+#define ELAN_GAP_BUCKETS (ELAN_DELAY_MAX_USEC / ELAN_GAP_BUCKET_USEC)
+#define ELAN_GAP_MIN_SAMPLES 16
+#define ELAN_GAP_DECAY_SAMPLES 256
+#define ELAN_SCAN_PERIOD_MAX_USEC 20000
+
+#define ELAN_AREA_TRESHOLD 16
+
+// a live frame following a delayed one is held back for this long
+#define ELAN_SYNC_NSEC 4000000ULL
+
+// a frame missing reports is sent half a scan period after its last
+// report, or after this until the period is known
+#define ELAN_FRAME_TIMEOUT_USEC 4000
+
+// positions are extrapolated by the lead plus the time since the frame,
+// velocities are in device units per us in Q16
+#define ELAN_PREDICT_SHIFT 16
+#define ELAN_PREDICT_MAX_DISTANCE 64
+// a longer interval between two positions of a contact starts over
+#define ELAN_PREDICT_MAX_DT_USEC 40000
+
+// the 1 euro filter, positions are in Q8, the smoothing factors in Q16,
+// the cutoffs in mHz and the speeds in device units per ms in Q8
+#define ELAN_SMOOTH_SHIFT 8
+#define ELAN_SMOOTH_BETA 50000
+#define ELAN_SMOOTH_D_CUTOFF_MHZ 1000
+// 1e9 / (2 pi), the time constant in us of a cutoff in mHz
+#define ELAN_SMOOTH_TAU_MHZ_USEC 159154943U
+
+
+struct elan_contact {
+	int in_report;
+	int x, y;
+	int tool;
+	int touch;
+};
+
+// values of one contact report
+struct elan_contact_report {
+	int x, y;
+	int tool;
+	int touch;
+	int btn_left;
+	int slot;
+	int num_contacts;
+	int scantime;
+	int area;
+};
+
+struct elan_frame {
+	// every slot, those not in the frame with their last values
+	const struct elan_contact *contacts;
+	// a bit per slot which is in the frame, released contacts have
+	// touch cleared
+	unsigned int slots;
+	int btn_left;
+	int timestamp;
+};
+
+struct elan_predictor {
+	int x, y;
+	int vx, vy;
+	int timestamp;
+	int samples;
+};
+
+struct elan_smoother_axis {
+	int value;
+	int speed;
+	int out;
+};
+
+struct elan_smoother {
+	struct elan_smoother_axis x, y;
+	int timestamp;
+	int samples;
+};
+
+struct elan_delay_estimator {
+	unsigned int gaps[ELAN_GAP_BUCKETS];
+	unsigned int num_gaps;
+	unsigned int gap_usec;
+	unsigned int scan_period_usec;
+	unsigned int delay_usec;
+};
+
+// the driver may change them at any time
+struct elan_core_params {
+	unsigned int delay_percentile;
+	unsigned int delay_min_us;
+	unsigned int delay_max_us;
+	// the lead of the prediction in us, 0 disables it, and the longest
+	// distance a position is moved by in device units
+	unsigned int predict_us;
+	unsigned int predict_max;
+	// the minimum cutoff of the smoothing in mHz, 0 disables it, the
+	// cutoff increase per device unit per ms of speed, and the distance
+	// in device units the position of a contact has to change by
+	unsigned int smooth_cutoff_mhz;
+	unsigned int smooth_beta;
+	unsigned int smooth_hysteresis;
+};
+
+enum elan_core_timer {
+	ELAN_TIMER_RELEASE,
+	ELAN_TIMER_SYNC,
+	ELAN_TIMER_FRAME,
+	ELAN_NUM_TIMERS
+};
+
+enum elan_core_event {
+	// the value is the number of contacts
+	ELAN_EVENT_FRAME,
+	// the delay in us
+	ELAN_EVENT_RELEASE_DELAYED,
+	// the hold time of the release in ns
+	ELAN_EVENT_RELEASE_SENT,
+	ELAN_EVENT_RELEASE_DROPPED,
+	// a frame is sent without some of its reports, the value is the
+	// number of the missing ones, 1 if the first report is missing
+	ELAN_EVENT_FRAME_PARTIAL,
+};
+
+struct elan_core_ops {
+	// monotonic time in ns
+	uint64_t (*now)(void *ctx);
+	void (*emit)(void *ctx, const struct elan_frame *frame);
+	// an absolute deadline on the clock of now, zero cancels the timer,
+	// an expired timer calls elan_core_timer
+	void (*arm)(void *ctx, enum elan_core_timer timer, uint64_t deadline);
+	// optional, for statistics and tracing
+	void (*observe)(void *ctx, enum elan_core_event event, uint64_t value);
+};
+
+struct elan_core {
+	const struct elan_core_ops *ops;
+	void *ctx;
+	const struct elan_core_params *params;
+
+	// a pending release is the state of the frame which reported it,
+	// no report changes it before the release is sent or dropped
+	struct elan_contact hw_state[ELAN_MAX_CONTACTS];
+
+	int left_button_state;
+	// the frame being assembled, its reports share the scan time, zero
+	// expected reports if its first report is missing
+	int frame_open;
+	int frame_scantime;
+	int frame_btn_left;
+	int num_expected;
+	int num_received;
+	// the contacts missing in the frame keep their state
+	int frame_partial;
+	int delayed_pending;
+	int frame_deferred;
+	uint64_t sync_until;
+
+	struct elan_delay_estimator est;
+	uint64_t release_time;
+	int release_sent;
+
+	uint64_t time;
+	int timestamp;
+	int prev_scantime;
+	int scantime_logical_max;
+
+	// the emitted positions when they are smoothed or predicted, the
+	// axes are clamped to the maximums if the driver sets them
+	struct elan_smoother smooth[ELAN_MAX_CONTACTS];
+	struct elan_predictor pred[ELAN_MAX_CONTACTS];
+	struct elan_contact output[ELAN_MAX_CONTACTS];
+	int x_max, y_max;
+};
+
+
+static inline void elan_estimator_update(struct elan_core *core)
+{
+	struct elan_delay_estimator *est = &core->est;
+	unsigned int delay_min = ELAN_READ_ONCE(core->params->delay_min_us);
+	unsigned int delay_max = ELAN_READ_ONCE(core->params->delay_max_us);
+	unsigned int delay = ELAN_DELAY_USEC;
+
+	// the scan period is a margin since the gaps are quantised by it
+	if (est->num_gaps >= ELAN_GAP_MIN_SAMPLES)
+		delay = est->gap_usec + est->scan_period_usec;
+	if (delay_max > ELAN_DELAY_MAX_USEC)
+		delay_max = ELAN_DELAY_MAX_USEC;
+	if (delay < delay_min)
+		delay = delay_min;
+	if (delay > delay_max)
+		delay = delay_max;
+	est->delay_usec = delay;
+}
+
+
+static inline void elan_estimator_add_gap(struct elan_core *core, uint64_t gap)
+{
+	struct elan_delay_estimator *est = &core->est;
+	unsigned int percentile = ELAN_READ_ONCE(core->params->delay_percentile);
+	unsigned int target, sum = 0;
+	int i;
+
+	if (percentile < 1)
+		percentile = 1;
+	if (percentile > 100)
+		percentile = 100;
+
+	i = gap < ELAN_GAP_BUCKETS * ELAN_GAP_BUCKET_USEC ?
+		(int)gap / ELAN_GAP_BUCKET_USEC : ELAN_GAP_BUCKETS - 1;
+	est->gaps[i]++;
+	est->num_gaps++;
+
+	// halve the history so the estimate follows the hardware
+	if (est->num_gaps >= ELAN_GAP_DECAY_SAMPLES) {
+		est->num_gaps = 0;
+		for (i = 0; i < ELAN_GAP_BUCKETS; i++) {
+			est->gaps[i] >>= 1;
+			est->num_gaps += est->gaps[i];
+		}
+	}
+
+	target = (est->num_gaps * percentile + 99) / 100;
+	for (i = 0; i < ELAN_GAP_BUCKETS - 1; i++) {
+		sum += est->gaps[i];
+		if (sum >= target)
+			break;
+	}
+	est->gap_usec = (i + 1) * ELAN_GAP_BUCKET_USEC;
+
+	elan_estimator_update(core);
+}
+
+
+static inline void elan_estimator_add_scan(struct elan_core *core, long period)
+{
+	struct elan_delay_estimator *est = &core->est;
+
+	if (!est->scan_period_usec)
+		est->scan_period_usec = period;
+	else
+		est->scan_period_usec += (period - (long)est->scan_period_usec) / 8;
+
+	elan_estimator_update(core);
+}
+
+
+static inline void elan_core_init(struct elan_core *core,
+				const struct elan_core_ops *ops, void *ctx,
+				const struct elan_core_params *params)
+{
+	int i;
+
+	memset(core, 0, sizeof(*core));
+	core->ops = ops;
+	core->ctx = ctx;
+	core->params = params;
+
+	for (i = 0; i < ELAN_MAX_CONTACTS; i++)
+		core->hw_state[i].tool = 1;
+
+	core->time = ops->now(ctx);
+	core->x_max = core->y_max = 0;
+	core->scantime_logical_max = ELAN_MAX_SCANTIME;
+	elan_estimator_update(core);
+}
+
+
+// decodes a raw report, returns 0 if it's a contact report to be
+// passed to elan_core_report
+static inline int elan_core_decode(const uint8_t *buf, int size,
+				struct elan_contact_report *r)
+{
+	int state;
+
+	// ignore 0x40 event
+	if (size != ELAN_REPORT_SIZE || buf[0] != ELAN_REPORT_ID || buf[1] == 0x40)
+		return -1;
+
+	// ignore irrelevant states if any
+	state = buf[1] & 0x0f;
+	if (state != 3 && state != 1)
+		return -1;
+
+	r->slot = buf[1] >> 4;
+	r->touch = state == 3;
+	r->x = ((buf[3] & 0x0f) << 8) | buf[2];
+	r->y = ((buf[5] & 0x0f) << 8) | buf[4];
+	r->scantime = (buf[7] << 8) | buf[6];
+	r->num_contacts = buf[8];
+	r->tool = (buf[9] >> 1) < 38;
+	r->btn_left = buf[9] & 0x01;
+
+	// ? = buf[9]
+	// ? = buf[10]
+	// some combined data of the duration of contact
+	// which resets after inactivity,
+	// contact area and clickpad button
+
+	r->area = (buf[11] & 0x0f) * (buf[11] >> 4);
+	return 0;
+}
+
+
+static inline void elan_core_observe(struct elan_core *core,
+				enum elan_core_event event, uint64_t value)
+{
+	if (core->ops->observe)
+		core->ops->observe(core->ctx, event, value);
+}
+
+
+static inline int elan_core_timestamp(struct elan_core *core, int value,
+				uint64_t now)
+{
+	long delta = value - core->prev_scantime;
+	uint64_t tsdelta = elan_ns_to_us(now - core->time);
+
+	core->time = now;
+
+	if (delta < 0)
+		delta += core->scantime_logical_max;
+
+	delta *= 100;
+
+	core->prev_scantime = value;
+
+	// only consecutive frames of a touch tell the scan period
+	if (delta > 0 && delta < ELAN_SCAN_PERIOD_MAX_USEC &&
+	    tsdelta < 2 * ELAN_SCAN_PERIOD_MAX_USEC)
+		elan_estimator_add_scan(core, delta);
+
+	if (tsdelta > ELAN_MAX_TIMESTAMP_INTERVAL)
+		return 0;
+	else
+		return core->timestamp + delta;
+}
+
+
+static inline int elan_predict_axis(int value, int v, unsigned int lead,
+				int max_distance, int max)
+{
+	int64_t d = ((int64_t)v * lead) >> ELAN_PREDICT_SHIFT;
+
+	if (d > max_distance)
+		d = max_distance;
+	if (d < -max_distance)
+		d = -max_distance;
+	value += (int)d;
+	if (value < 0)
+		value = 0;
+	if (max > 0 && value > max)
+		value = max;
+	return value;
+}
+
+
+static inline int elan_clamp_delta(int d)
+{
+	return d > 0x7fff ? 0x7fff : d < -0x7fff ? -0x7fff : d;
+}
+
+
+// the velocity follows the scan time deltas of the frames, it's the
+// mean of the last two, a touch-down or a lift starts over
+static inline void elan_predictor_update(struct elan_predictor *p,
+				const struct elan_contact *ct, int timestamp)
+{
+	unsigned int dt = (unsigned int)timestamp - (unsigned int)p->timestamp;
+	int dx, dy, vx, vy;
+
+	if (!ct->touch) {
+		p->samples = 0;
+		return;
+	}
+	if (p->samples && dt > 0 && dt < ELAN_PREDICT_MAX_DT_USEC) {
+		// a delta of 15 bits fits in Q16
+		dx = elan_clamp_delta(ct->x - p->x);
+		dy = elan_clamp_delta(ct->y - p->y);
+		vx = dx * (1 << ELAN_PREDICT_SHIFT) / (int)dt;
+		vy = dy * (1 << ELAN_PREDICT_SHIFT) / (int)dt;
+		p->vx = p->samples > 1 ? p->vx / 2 + vx / 2 : vx;
+		p->vy = p->samples > 1 ? p->vy / 2 + vy / 2 : vy;
+		p->samples = 2;
+	} else if (!p->samples || dt) {
+		p->vx = p->vy = 0;
+		p->samples = 1;
+	}
+	p->x = ct->x;
+	p->y = ct->y;
+	p->timestamp = timestamp;
+}
+
+
+// the smoothing factor of a low pass filter with the cutoff for dt
+static inline int elan_smooth_alpha(unsigned int cutoff_mhz, unsigned int dt)
+{
+	unsigned int tau = ELAN_SMOOTH_TAU_MHZ_USEC / (cutoff_mhz ? cutoff_mhz : 1);
+
+	return (int)((dt << 16) / (dt + tau));
+}
+
+
+static inline int elan_smooth_axis(struct elan_smoother_axis *a, int raw,
+				unsigned int dt, unsigned int cutoff_mhz,
+				unsigned int beta)
+{
+	int value = raw * (1 << ELAN_SMOOTH_SHIFT);
+	int64_t speed;
+	unsigned int cutoff;
+
+	// the speed is limited so the filter state stays in an int
+	speed = elan_div_s64((int64_t)(value - a->value) * 1000, dt);
+	if (speed > 0x3fffffff)
+		speed = 0x3fffffff;
+	if (speed < -0x3fffffff)
+		speed = -0x3fffffff;
+	a->speed += (int)((speed - a->speed) *
+			  elan_smooth_alpha(ELAN_SMOOTH_D_CUTOFF_MHZ, dt) >> 16);
+
+	// faster contacts are followed more closely
+	speed = a->speed < 0 ? -(int64_t)a->speed : a->speed;
+	speed = (speed * beta) >> ELAN_SMOOTH_SHIFT;
+	cutoff = speed < 0xffffffffLL - cutoff_mhz ?
+		cutoff_mhz + (unsigned int)speed : 0xffffffff;
+	a->value += (int)((int64_t)(value - a->value) *
+			  elan_smooth_alpha(cutoff, dt) >> 16);
+
+	return (a->value + (1 << (ELAN_SMOOTH_SHIFT - 1))) >> ELAN_SMOOTH_SHIFT;
+}
+
+
+// the 1 euro filter on the scan time deltas of the frames, a touch-down
+// or a lift starts over
+static inline void elan_smoother_update(struct elan_smoother *sm,
+				struct elan_contact *ct, int timestamp,
+				unsigned int cutoff_mhz, unsigned int beta)
+{
+	unsigned int dt = (unsigned int)timestamp - (unsigned int)sm->timestamp;
+
+	if (!ct->touch) {
+		sm->samples = 0;
+		return;
+	}
+	if (sm->samples && dt > 0 && dt < ELAN_PREDICT_MAX_DT_USEC && cutoff_mhz) {
+		ct->x = elan_smooth_axis(&sm->x, ct->x, dt, cutoff_mhz, beta);
+		ct->y = elan_smooth_axis(&sm->y, ct->y, dt, cutoff_mhz, beta);
+	} else if (!sm->samples || dt || !cutoff_mhz) {
+		// the filter follows the contact while it's disabled
+		sm->x.value = ct->x * (1 << ELAN_SMOOTH_SHIFT);
+		sm->y.value = ct->y * (1 << ELAN_SMOOTH_SHIFT);
+		sm->x.speed = sm->y.speed = 0;
+		if (!sm->samples) {
+			sm->x.out = ct->x;
+			sm->y.out = ct->y;
+		}
+	} else {
+		// the same frame again
+		ct->x = (sm->x.value + (1 << (ELAN_SMOOTH_SHIFT - 1))) >> ELAN_SMOOTH_SHIFT;
+		ct->y = (sm->y.value + (1 << (ELAN_SMOOTH_SHIFT - 1))) >> ELAN_SMOOTH_SHIFT;
+	}
+	sm->samples = 1;
+	sm->timestamp = timestamp;
+}
+
+
+// a resting contact sends nothing while it stays within the distance
+static inline int elan_hysteresis(int *out, int value, int distance)
+{
+	if (value > *out + distance || value < *out - distance)
+		*out = value;
+	return *out;
+}
+
+
+// the contacts of the frame with the smoothed and the predicted positions
+static inline const struct elan_contact *elan_core_filter(
+				struct elan_core *core, unsigned int slots,
+				unsigned int cutoff_mhz, unsigned int lead_us)
+{
+	unsigned int beta = ELAN_READ_ONCE(core->params->smooth_beta);
+	unsigned int hysteresis = ELAN_READ_ONCE(core->params->smooth_hysteresis);
+	unsigned int max_distance = ELAN_READ_ONCE(core->params->predict_max);
+	struct elan_contact *out = core->output;
+	struct elan_smoother *sm;
+	struct elan_predictor *p;
+	uint64_t age;
+	int distance, i;
+
+	// the frame may have been held back by the filter
+	age = elan_ns_to_us(core->ops->now(core->ctx) - core->time);
+	if (lead_us && age < ELAN_PREDICT_MAX_DT_USEC)
+		lead_us += (unsigned int)age;
+	distance = max_distance < 0xffff ? (int)max_distance : 0xffff;
+	if (hysteresis > 0xffff)
+		hysteresis = 0xffff;
+
+	for (i = 0; i < ELAN_MAX_CONTACTS; i++) {
+		sm = &core->smooth[i];
+		p = &core->pred[i];
+		// a contact missing in a partial frame keeps its last
+		// position, the output may take the single touch axes from it
+		if (!(slots & (1U << i))) {
+			if (!sm->samples && !p->samples)
+				out[i] = core->hw_state[i];
+			continue;
+		}
+		out[i] = core->hw_state[i];
+		elan_smoother_update(sm, &out[i], core->timestamp, cutoff_mhz, beta);
+		elan_predictor_update(p, &out[i], core->timestamp);
+		if (!out[i].touch)
+			continue;
+		if (lead_us && p->samples >= 2) {
+			out[i].x = elan_predict_axis(out[i].x, p->vx, lead_us,
+						     distance, core->x_max);
+			out[i].y = elan_predict_axis(out[i].y, p->vy, lead_us,
+						     distance, core->y_max);
+		}
+		if (hysteresis) {
+			out[i].x = elan_hysteresis(&sm->x.out, out[i].x, hysteresis);
+			out[i].y = elan_hysteresis(&sm->y.out, out[i].y, hysteresis);
+		}
+	}
+	return out;
+}
+
+
+static inline void elan_core_send(struct elan_core *core)
+{
+	struct elan_contact *state = core->hw_state;
+	struct elan_contact *ct;
+	struct elan_frame frame;
+	unsigned int lead_us, cutoff_mhz;
+	int i;
+
+	frame.contacts = state;
+	frame.slots = 0;
+	frame.btn_left = core->left_button_state;
+	frame.timestamp = core->timestamp;
+
+	for (i = 0; i < ELAN_MAX_CONTACTS; i++) {
+		ct = &state[i];
+		if (!ct->in_report) {
+			// sometimes the touchpad forgets to report releases
+			// every contact which touches the surface is always
+			// reported otherwise mark it released
+			if (ct->touch && !core->frame_partial)
+				ct->touch = 0;
+			else
+				continue;
+		}
+		frame.slots |= 1U << i;
+		ct->in_report = 0;
+	}
+	core->frame_partial = 0;
+
+	lead_us = ELAN_READ_ONCE(core->params->predict_us);
+	cutoff_mhz = ELAN_READ_ONCE(core->params->smooth_cutoff_mhz);
+	if (lead_us || cutoff_mhz || ELAN_READ_ONCE(core->params->smooth_hysteresis))
+		frame.contacts = elan_core_filter(core, frame.slots, cutoff_mhz,
+						  lead_us);
+
+	core->ops->emit(core->ctx, &frame);
+}
+
+
+static inline void elan_core_send_delayed(struct elan_core *core, uint64_t now)
+{
+	elan_core_observe(core, ELAN_EVENT_RELEASE_SENT, now - core->release_time);
+	core->release_sent = 1;
+	elan_core_send(core);
+	core->sync_until = now + ELAN_SYNC_NSEC;
+}
+
+
+static inline uint64_t elan_core_frame_timeout(struct elan_core *core)
+{
+	unsigned int period = core->est.scan_period_usec;
+
+	return (period ? period / 2 : ELAN_FRAME_TIMEOUT_USEC) * 1000ULL;
+}
+
+
+// the last report completes the frame, without it the frame is partial,
+// either the next frame has started or its timeout has expired
+static inline void elan_core_frame_done(struct elan_core *core,
+				const struct elan_contact_report *r,
+				uint64_t now)
+{
+	core->frame_open = 0;
+	core->ops->arm(core->ctx, ELAN_TIMER_FRAME, 0);
+
+	core->left_button_state = core->frame_btn_left;
+
+	core->timestamp = elan_core_timestamp(core, core->frame_scantime, now);
+
+	if (!r) {
+		core->frame_partial = 1;
+		elan_core_observe(core, ELAN_EVENT_FRAME_PARTIAL,
+				  core->num_expected > core->num_received ?
+				  core->num_expected - core->num_received : 1);
+	}
+	elan_core_observe(core, ELAN_EVENT_FRAME, core->num_received);
+
+	if (r && r->num_contacts == 1 && !r->touch && r->area > ELAN_AREA_TRESHOLD) {
+		// the delayed frame supersedes a deferred one
+		core->frame_deferred = 0;
+		core->ops->arm(core->ctx, ELAN_TIMER_SYNC, 0);
+		core->release_time = now;
+		core->ops->arm(core->ctx, ELAN_TIMER_RELEASE,
+			       now + core->est.delay_usec * 1000ULL);
+		core->delayed_pending = 1;
+		elan_core_observe(core, ELAN_EVENT_RELEASE_DELAYED, core->est.delay_usec);
+	} else if (core->sync_until && now < core->sync_until) {
+		// don't block, the sync timer sends the frame,
+		// reports keep being assembled in the meantime
+		core->frame_deferred = 1;
+		core->ops->arm(core->ctx, ELAN_TIMER_SYNC, core->sync_until);
+	} else {
+		core->sync_until = 0;
+		core->frame_deferred = 0;
+		elan_core_send(core);
+	}
+}
+
+
+static inline void elan_core_timer(struct elan_core *core,
+				enum elan_core_timer timer)
+{
+	uint64_t now = core->ops->now(core->ctx);
+
+	switch (timer) {
+	case ELAN_TIMER_RELEASE:
+		if (core->delayed_pending) {
+			core->delayed_pending = 0;
+			elan_core_send_delayed(core, now);
+		}
+		break;
+	case ELAN_TIMER_SYNC:
+		// a frame being assembled is sent as soon as it's complete
+		if (core->frame_deferred && !core->frame_open) {
+			core->frame_deferred = 0;
+			elan_core_send(core);
+		}
+		break;
+	case ELAN_TIMER_FRAME:
+		if (core->frame_open)
+			elan_core_frame_done(core, NULL, now);
+		break;
+	default:
+		break;
+	}
+}
+
+
+static inline void elan_core_report(struct elan_core *core,
+				const struct elan_contact_report *r)
+{
+	uint64_t now = core->ops->now(core->ctx);
+	uint64_t gap = now - core->release_time;
+	struct elan_contact *ct;
+
+	if (r->slot < 0 || r->slot >= ELAN_MAX_CONTACTS)
+		return;
+
+	if (core->delayed_pending) {
+		core->delayed_pending = 0;
+		core->ops->arm(core->ctx, ELAN_TIMER_RELEASE, 0);
+		if (r->num_contacts == 1) {
+			elan_core_send_delayed(core, now);
+			core->release_sent = 0;
+		} else {
+			elan_core_observe(core, ELAN_EVENT_RELEASE_DROPPED, gap);
+			elan_estimator_add_gap(core, elan_ns_to_us(gap));
+		}
+	} else if (core->release_sent) {
+		// the release was reported too early if the contacts are back
+		core->release_sent = 0;
+		if (r->num_contacts > 1 &&
+		    gap < ELAN_READ_ONCE(core->params->delay_max_us) * 1000ULL)
+			elan_estimator_add_gap(core, elan_ns_to_us(gap));
+	}
+
+	// the first report of a frame has the number of contacts and every
+	// report of it the same scan time, a report of another frame ends
+	// the one being assembled
+	if (core->frame_open &&
+	    (r->num_contacts || r->scantime != core->frame_scantime))
+		elan_core_frame_done(core, NULL, now);
+
+	if (!core->frame_open) {
+		core->frame_open = 1;
+		core->frame_scantime = r->scantime;
+		core->num_expected = r->num_contacts;
+		core->num_received = 0;
+	}
+
+	core->num_received++;
+	core->frame_btn_left = r->btn_left;
+
+	ct = &core->hw_state[r->slot];
+	ct->in_report = 1;
+	ct->tool = r->tool;
+	ct->x = r->x;
+	ct->y = r->y;
+	ct->touch = r->touch;
+
+	if (core->num_expected && core->num_received >= core->num_expected)
+		elan_core_frame_done(core, r, now);
+	else
+		core->ops->arm(core->ctx, ELAN_TIMER_FRAME,
+			       now + elan_core_frame_timeout(core));
+}
+
+#endif
@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ *  Tracepoints of the Elan1200 Touchpad driver
+ *
+ *  The events are in the elan1200 group, e.g.
+ *  perf trace -e 'elan1200:*' or
+ *  echo 1 > /sys/kernel/tracing/events/elan1200/enable
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM elan1200
+
+#if !defined(_HID_ELAN1200_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _HID_ELAN1200_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(elan_report_received,
+	TP_PROTO(unsigned int dev, int slot, bool touch, int x, int y,
+		 int num_contacts),
+	TP_ARGS(dev, slot, touch, x, y, num_contacts),
+	TP_STRUCT__entry(
+		__field(unsigned int, dev)
+		__field(int, slot)
+		__field(bool, touch)
+		__field(int, x)
+		__field(int, y)
+		__field(int, num_contacts)
+	),
+	TP_fast_assign(
+		__entry->dev = dev;
+		__entry->slot = slot;
+		__entry->touch = touch;
+		__entry->x = x;
+		__entry->y = y;
+		__entry->num_contacts = num_contacts;
+	),
+	TP_printk("dev=%u slot=%d touch=%d x=%d y=%d contacts=%d",
+		  __entry->dev, __entry->slot, __entry->touch,
+		  __entry->x, __entry->y, __entry->num_contacts)
+);
+
+TRACE_EVENT(elan_frame_assembled,
+	TP_PROTO(unsigned int dev, int num_contacts, int timestamp),
+	TP_ARGS(dev, num_contacts, timestamp),
+	TP_STRUCT__entry(
+		__field(unsigned int, dev)
+		__field(int, num_contacts)
+		__field(int, timestamp)
+	),
+	TP_fast_assign(
+		__entry->dev = dev;
+		__entry->num_contacts = num_contacts;
+		__entry->timestamp = timestamp;
+	),
+	TP_printk("dev=%u contacts=%d timestamp=%d",
+		  __entry->dev, __entry->num_contacts, __entry->timestamp)
+);
+
+// the frame is sent without some of its reports
+TRACE_EVENT(elan_frame_partial,
+	TP_PROTO(unsigned int dev, unsigned int missing),
+	TP_ARGS(dev, missing),
+	TP_STRUCT__entry(
+		__field(unsigned int, dev)
+		__field(unsigned int, missing)
+	),
+	TP_fast_assign(
+		__entry->dev = dev;
+		__entry->missing = missing;
+	),
+	TP_printk("dev=%u missing=%u", __entry->dev, __entry->missing)
+);
+
+TRACE_EVENT(elan_release_delayed,
+	TP_PROTO(unsigned int dev, unsigned int delay_us),
+	TP_ARGS(dev, delay_us),
+	TP_STRUCT__entry(
+		__field(unsigned int, dev)
+		__field(unsigned int, delay_us)
+	),
+	TP_fast_assign(
+		__entry->dev = dev;
+		__entry->delay_us = delay_us;
+	),
+	TP_printk("dev=%u delay=%uus", __entry->dev, __entry->delay_us)
+);
+
+DECLARE_EVENT_CLASS(elan_release_hold,
+	TP_PROTO(unsigned int dev, s64 hold_us),
+	TP_ARGS(dev, hold_us),
+	TP_STRUCT__entry(
+		__field(unsigned int, dev)
+		__field(s64, hold_us)
+	),
+	TP_fast_assign(
+		__entry->dev = dev;
+		__entry->hold_us = hold_us;
+	),
+	TP_printk("dev=%u hold=%lldus", __entry->dev, __entry->hold_us)
+);
+
+// the delayed release is sent, by the timer or by the next report
+DEFINE_EVENT(elan_release_hold, elan_release_fired,
+	TP_PROTO(unsigned int dev, s64 hold_us),
+	TP_ARGS(dev, hold_us)
+);
+
+// the contacts are back, the release was a ghost one
+DEFINE_EVENT(elan_release_hold, elan_release_cancelled,
+	TP_PROTO(unsigned int dev, s64 hold_us),
+	TP_ARGS(dev, hold_us)
+);
+
+#endif /* _HID_ELAN1200_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE hid-elan1200-trace
+#include <trace/define_trace.h>
@@ -13,88 +13,112 @@
  */
 
 #include <linux/module.h>
-#include <linux/delay.h>
 #include <linux/hid.h>
+#include <linux/hidraw.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <linux/input/mt.h>
 
+#include "elan_core.h"
+
+#define CREATE_TRACE_POINTS
+#include "hid-elan1200-trace.h"
+
 
 MODULE_AUTHOR("Alexander Mishurov <ammishurov@gmail.com>");
 MODULE_DESCRIPTION("Elan1200 Touchpad");
 MODULE_LICENSE("GPL");
 
 
-#define DELAY 16
-#define DELAY_NS DELAY * 1000000
-
-#define AREA_TRESHOLD 16
+// hold durations of delayed releases in debugfs
+#define HOLD_BUCKET_USEC 500
+#define HOLD_BUCKETS 64
 
-#ifdef MEASURE_TIME
-static unsigned long start_j, stop_j;
-
-static inline int
-j_delta_msec(unsigned long *a, unsigned long *b) {
-	return jiffies_to_msecs(*a - *b);
-}
-#endif
+static struct elan_core_params elan_params = {
+	.delay_percentile = ELAN_DELAY_PERCENTILE,
+	.delay_min_us = ELAN_DELAY_MIN_USEC,
+	.delay_max_us = ELAN_DELAY_MAX_USEC,
+	.predict_max = ELAN_PREDICT_MAX_DISTANCE,
+	.smooth_beta = ELAN_SMOOTH_BETA,
+};
+module_param_named(delay_percentile, elan_params.delay_percentile, uint, 0644);
+MODULE_PARM_DESC(delay_percentile, "Percentile of re-touch gaps to delay releases for");
+module_param_named(delay_min_us, elan_params.delay_min_us, uint, 0644);
+MODULE_PARM_DESC(delay_min_us, "Shortest release delay in microseconds");
+module_param_named(delay_max_us, elan_params.delay_max_us, uint, 0644);
+MODULE_PARM_DESC(delay_max_us, "Longest release delay in microseconds");
+module_param_named(predict_us, elan_params.predict_us, uint, 0644);
+MODULE_PARM_DESC(predict_us, "Extrapolate the positions this many microseconds ahead, 0 disables");
+module_param_named(predict_max, elan_params.predict_max, uint, 0644);
+MODULE_PARM_DESC(predict_max, "Longest distance a position is extrapolated by in device units");
+module_param_named(smooth_cutoff_mhz, elan_params.smooth_cutoff_mhz, uint, 0644);
+MODULE_PARM_DESC(smooth_cutoff_mhz, "Minimum cutoff of the position smoothing in mHz, 0 disables");
+module_param_named(smooth_beta, elan_params.smooth_beta, uint, 0644);
+MODULE_PARM_DESC(smooth_beta, "Cutoff increase in mHz per device unit per ms of speed");
+module_param_named(smooth_hysteresis, elan_params.smooth_hysteresis, uint, 0644);
+MODULE_PARM_DESC(smooth_hysteresis, "Distance in device units a position has to change by, 0 disables");
+
+static unsigned int elan_idle_ms;
+module_param_named(idle_ms, elan_idle_ms, uint, 0644);
+MODULE_PARM_DESC(idle_ms, "Switch to the high latency mode after this many milliseconds without touches, 0 disables");
 
 #define INPUT_DEV_TOUCHPAD_NAME "FilteredELAN1200"
 #define INPUT_DEV_MOUSE_NAME "ELAN1200 Mouse"
 
-#define MAX_CONTACTS 5
-#define MAX_TIMESTAMP_INTERVAL 1000000
-
 #define USB_VENDOR_ID_ELAN 0x04f3
 #define USB_DEVICE_ID_1200 0x3022
 
 #define INPUT_MODE_TOUCHPAD 0x03
 #define LATENCY_MODE_NORMAL 0x00
+#define LATENCY_MODE_HIGH 0x01
 
-#define MT_ID_NULL	(-1)
-#define MT_ID_MIN	0
-#define MT_ID_MAX	65535
-#define MT_ID_SGN	((MT_ID_MAX + 1) >> 1)
-
-#define DELAYED_FLAG_PENDING	0
-#define DELAYED_FLAG_RUNNING	1
-
-#define INPUT_SYNC_UDELAY 4000
-
-#define ELAN_REPORT_ID 0x04
-#define ELAN_REPORT_SIZE 14
 // report size in bits without a report id byte
 #define ELAN_REPORT_SIZE_BITS (ELAN_REPORT_SIZE - 1) * 8
 
 #define WH_HID 0x900c5
 #define WH_INDEX 1
 
-struct contact {
-	bool in_report;
-	__s32 x;
-	__s32 y;
-	bool tool;
-	bool touch;
+struct elan_counters {
+	unsigned long reports;
+	unsigned long frames;
+	unsigned long releases_delayed;
+	unsigned long releases_sent;
+	unsigned long releases_dropped;
+	unsigned long frames_partial;
+	unsigned long reports_lost;
+	unsigned long latency_high;
+	unsigned long latency_normal;
+	// the time in the high latency mode until the last wakeup
+	u64 idle_ns;
+	// the last bucket takes everything longer
+	unsigned long hold[HOLD_BUCKETS];
 };
 
 struct elan_application {
 	struct input_dev *input;
-
-	struct contact hw_state[MAX_CONTACTS];
-	struct contact delayed_state[MAX_CONTACTS];
-
-	bool left_button_state;
-	__s32 num_expected;
-	__s32 num_received;
-
-	int area;
-
-	unsigned long delayed_flags;
-	struct timer_list timer;
-
-	__s32 dev_time;
-	unsigned long jiffies;
-	int timestamp;
-	int prev_scantime;
-	__s32 scantime_logical_max;
+	// hid device id in the tracepoints
+	unsigned int id;
+
+	// serialises the reports and the timers
+	spinlock_t lock;
+	struct elan_core core;
+	struct hrtimer timer;
+	struct hrtimer sync_timer;
+	struct hrtimer frame_timer;
+
+	// the time of the last report, the latency mode is switched from
+	// a work item since the requests sleep
+	u64 report_time;
+	bool idle;
+	u64 idle_since;
+	struct delayed_work idle_work;
+	// set on removal under the lock, no report or timer reaches the
+	// core and no work is queued anymore
+	bool removed;
+
+	struct elan_counters counters;
 };
 
 struct elan_features {
@@ -116,185 +140,311 @@ struct elan_usages {
 
 struct elan_device {
 	struct hid_device *hdev;
+	struct dentry *debugfs;
+	// the touch report matches elan_raw_layout and is decoded in raw_event
+	bool raw_reports;
 	struct elan_usages usages;
+	// the contact area of the report being parsed
+	int area;
 	struct elan_application app;
 	struct elan_features features;
 };
 
 
-static void init_app_vars(struct elan_application *app) {
-	int i;
+static u64 elan_now(void *ctx)
+{
+	return ktime_get_ns();
+}
 
-	app->timestamp = 0;
-	app->jiffies = jiffies;
-	app->prev_scantime = 0;
 
-	app->left_button_state = 0;
-	app->num_received = 0;
+static void elan_emit(void *ctx, const struct elan_frame *frame)
+{
+	struct elan_application *app = ctx;
+	struct input_dev *input = app->input;
+	const struct elan_contact *ct;
+	int i;
+
+	for (i = 0; i < ELAN_MAX_CONTACTS; i++) {
+		if (!(frame->slots & BIT(i)))
+			continue;
+		ct = &frame->contacts[i];
 
-	app->area = 0;
+		input_mt_slot(input, i);
+		input_mt_report_slot_state(input,
+				likely(ct->tool) ? MT_TOOL_FINGER : MT_TOOL_PALM,
+				ct->touch);
 
-	for (i = 0; i < MAX_CONTACTS; i++) {
-		struct contact* hw = &app->hw_state[i];
-		hw->in_report = 0;
-		hw->x = hw->y = 0;
-		hw->tool = 1;
-		hw->touch = 0;
+		if (ct->touch) {
+			input_event(input, EV_ABS, ABS_MT_POSITION_X, ct->x);
+			input_event(input, EV_ABS, ABS_MT_POSITION_Y, ct->y);
+		}
 	}
 
-	clear_bit(DELAYED_FLAG_PENDING, &app->delayed_flags);
-	clear_bit(DELAYED_FLAG_RUNNING, &app->delayed_flags);
-}
+	input_event(input, EV_KEY, BTN_LEFT, frame->btn_left);
 
+	input_mt_sync_frame(input);
 
-static int mt_compute_timestamp(struct elan_application *app, __s32 value)
-{
-	long delta = value - app->prev_scantime;
-	unsigned long jdelta = jiffies_to_usecs(jiffies - app->jiffies);
+	input_event(input, EV_MSC, MSC_TIMESTAMP, frame->timestamp);
 
-	app->jiffies = jiffies;
+	input_sync(input);
+}
 
-	if (delta < 0)
-		delta += app->scantime_logical_max;
 
-	delta *= 100;
+// called with app->lock held
+static void elan_arm(void *ctx, enum elan_core_timer timer, u64 deadline)
+{
+	struct elan_application *app = ctx;
+	struct hrtimer *t;
 
-	app->prev_scantime = value;
+	switch (timer) {
+	case ELAN_TIMER_RELEASE:
+		t = &app->timer;
+		break;
+	case ELAN_TIMER_SYNC:
+		t = &app->sync_timer;
+		break;
+	default:
+		t = &app->frame_timer;
+		break;
+	}
 
-	if (jdelta > MAX_TIMESTAMP_INTERVAL)
-		return 0;
+	// the callback may be waiting for the lock, it finds nothing pending
+	// or the timer armed again
+	if (!deadline)
+		hrtimer_try_to_cancel(t);
 	else
-		return app->timestamp + delta;
+		hrtimer_start(t, ns_to_ktime(deadline), HRTIMER_MODE_ABS_SOFT);
 }
 
 
-static void send_report(struct elan_application *app, bool delay)
+static void count_hold(struct elan_application *app, u64 hold)
 {
-	struct input_dev *input = app->input;
+	app->counters.hold[min_t(u64, div_u64(hold, HOLD_BUCKET_USEC), HOLD_BUCKETS - 1)]++;
+}
 
-	int i;
-	int tool = MT_TOOL_FINGER;
-	struct contact *ct;
-	struct contact *state = delay ? app->delayed_state : app->hw_state;
-
-	for (i = 0; i < MAX_CONTACTS; i++) {
-		ct = &(state[i]);
-		if (!ct->in_report) {
-			if (ct->touch)
-				ct->touch = 0;
-			else
-				continue;
-		}
 
-		input_mt_slot(input, i);
+static void elan_observe(void *ctx, enum elan_core_event event, u64 value)
+{
+	struct elan_application *app = ctx;
+	s64 hold = div_u64(value, NSEC_PER_USEC);
 
-		if (unlikely(!ct->tool))
-			tool = MT_TOOL_PALM;
+	switch (event) {
+	case ELAN_EVENT_FRAME:
+		trace_elan_frame_assembled(app->id, value, app->core.timestamp);
+		app->counters.frames++;
+		break;
+	case ELAN_EVENT_RELEASE_DELAYED:
+		trace_elan_release_delayed(app->id, value);
+		app->counters.releases_delayed++;
+		break;
+	case ELAN_EVENT_RELEASE_SENT:
+		trace_elan_release_fired(app->id, hold);
+		app->counters.releases_sent++;
+		count_hold(app, hold);
+		break;
+	case ELAN_EVENT_RELEASE_DROPPED:
+		trace_elan_release_cancelled(app->id, hold);
+		app->counters.releases_dropped++;
+		count_hold(app, hold);
+		break;
+	case ELAN_EVENT_FRAME_PARTIAL:
+		trace_elan_frame_partial(app->id, value);
+		app->counters.frames_partial++;
+		app->counters.reports_lost += value;
+		break;
+	}
+}
 
-		input_mt_report_slot_state(input, tool, ct->touch);
 
-		if (ct->touch) {
-			input_event(input, EV_ABS, ABS_MT_POSITION_X, ct->x);
-			input_event(input, EV_ABS, ABS_MT_POSITION_Y, ct->y);
-		}
+static const struct elan_core_ops elan_core_ops = {
+	.now = elan_now,
+	.emit = elan_emit,
+	.arm = elan_arm,
+	.observe = elan_observe,
+};
 
-		ct->in_report = 0;
-	}
 
-	if (delay)
-		memcpy(app->hw_state, app->delayed_state, sizeof(app->hw_state));
+// a timer armed again while its callback waited for the lock is queued
+// for the new deadline, the callback of the old one does nothing, after
+// the removal no callback arms the timers cancelled before it
+static enum hrtimer_restart elan_timer_expired(struct elan_application *app,
+				struct hrtimer *t, enum elan_core_timer timer)
+{
+	unsigned long flags;
 
-	input_event(input, EV_KEY, BTN_LEFT, app->left_button_state);
+	spin_lock_irqsave(&app->lock, flags);
+	if (!app->removed && !hrtimer_is_queued(t))
+		elan_core_timer(&app->core, timer);
+	spin_unlock_irqrestore(&app->lock, flags);
+	return HRTIMER_NORESTART;
+}
 
-	input_mt_sync_frame(input);
 
-	input_event(input, EV_MSC, MSC_TIMESTAMP, app->timestamp);
+static enum hrtimer_restart timer_thread(struct hrtimer *t)
+{
+	struct elan_application *app = container_of(t, struct elan_application, timer);
 
-	input_sync(input);
+	return elan_timer_expired(app, t, ELAN_TIMER_RELEASE);
 }
 
 
-static void timer_thread(struct timer_list *t)
+static enum hrtimer_restart sync_timer_thread(struct hrtimer *t)
 {
-	struct elan_application *app = from_timer(app, t, timer);
+	struct elan_application *app = container_of(t, struct elan_application, sync_timer);
 
-	set_bit(DELAYED_FLAG_RUNNING, &app->delayed_flags);
-	if (test_and_clear_bit(DELAYED_FLAG_PENDING, &app->delayed_flags)) {
-		send_report(app, 1);
-	}
-	clear_bit(DELAYED_FLAG_RUNNING, &app->delayed_flags);
-#ifdef MEASURE_TIME
-	stop_j = jiffies;
-	printk("Timer triggered: %d ms\n", j_delta_msec(&stop_j, &start_j));
-#endif
+	return elan_timer_expired(app, t, ELAN_TIMER_SYNC);
+}
+
+
+static enum hrtimer_restart frame_timer_thread(struct hrtimer *t)
+{
+	struct elan_application *app = container_of(t, struct elan_application, frame_timer);
+
+	return elan_timer_expired(app, t, ELAN_TIMER_FRAME);
 }
 
 
 static void elan_touchpad_report(struct elan_application *app,
-					struct elan_usages *usages) {
-	struct contact *ct;
+				const struct elan_contact_report *r) {
+	unsigned int idle_ms = READ_ONCE(elan_idle_ms);
+	unsigned long flags;
+
+	trace_elan_report_received(app->id, r->slot, r->touch,
+				   r->x, r->y, r->num_contacts);
+
+	// nothing is armed or queued once the removal has cancelled it all
+	spin_lock_irqsave(&app->lock, flags);
+	if (app->removed)
+		goto out;
+	app->counters.reports++;
+	app->report_time = ktime_get_ns();
+	elan_core_report(&app->core, r);
+
+	// the first touch wakes the device up right away, even if idle_ms
+	// has been cleared since, otherwise the idle check is queued once
+	// per period rather than on every report
+	if (READ_ONCE(app->idle))
+		mod_delayed_work(system_wq, &app->idle_work, 0);
+	else if (idle_ms && !delayed_work_pending(&app->idle_work))
+		schedule_delayed_work(&app->idle_work, msecs_to_jiffies(idle_ms));
+out:
+	spin_unlock_irqrestore(&app->lock, flags);
+}
 
-	if (test_and_clear_bit(DELAYED_FLAG_PENDING, &app->delayed_flags)) {
-		if (*usages->num_contacts == 1) {
-			send_report(app, 1);
-			udelay(INPUT_SYNC_UDELAY);
-		}
-#ifdef MEASURE_TIME
-		stop_j = jiffies;
-		printk("Next event arrived: %d ms\n", j_delta_msec(&stop_j, &start_j));
-#endif
-	} else if (test_bit(DELAYED_FLAG_RUNNING, &app->delayed_flags)) {
-		udelay(INPUT_SYNC_UDELAY);
-	}
 
-	if (*usages->num_contacts) {
-		app->num_expected = *usages->num_contacts;
-		app->num_received = 0;
+static void elan_report(struct hid_device *hdev, struct hid_report *report)
+{
+	struct hid_field *field = report->field[0];
+	struct elan_device *td = hid_get_drvdata(hdev);
+	struct elan_usages *usages = &td->usages;
+	struct elan_contact_report r;
+
+	if (!(hdev->claimed & HID_CLAIMED_INPUT))
+		return;
+
+	if (report->id == ELAN_REPORT_ID && report->size == ELAN_REPORT_SIZE_BITS) {
+		r.x = *usages->x;
+		r.y = *usages->y;
+		r.tool = *usages->tool;
+		r.touch = *usages->touch;
+		r.btn_left = *usages->btn_left;
+		r.slot = *usages->slot;
+		r.num_contacts = *usages->num_contacts;
+		r.scantime = *usages->scantime;
+		r.area = td->area;
+		return elan_touchpad_report(&td->app, &r);
 	}
 
-	app->num_received++;
+	if (field && field->hidinput && field->hidinput->input)
+		input_sync(field->hidinput->input);
+}
 
-	ct = &app->hw_state[*usages->slot];
-	ct->in_report = 1;
-	ct->tool = *usages->tool;
-	ct->x = *usages->x;
-	ct->y = *usages->y;
-	ct->touch = *usages->touch;
 
-	if (app->num_received < app->num_expected)
-		return;
+// the layout of the touch report the raw decoder expects, bit offsets
+// are after the report id, a field may be wider than the bits read if
+// its logical range fits into them
+struct elan_raw_usage {
+	unsigned int hid;
+	unsigned int index;
+	unsigned int offset;
+	unsigned int bits;
+};
 
-	app->left_button_state = *usages->btn_left;
+static const struct elan_raw_usage elan_raw_layout[] = {
+	{ HID_DG_CONFIDENCE, 0, 0, 1 },
+	{ HID_DG_TIPSWITCH, 0, 1, 1 },
+	{ HID_DG_CONTACTID, 0, 4, 4 },
+	{ HID_GD_X, 0, 8, 12 },
+	{ HID_GD_Y, 0, 24, 12 },
+	{ HID_DG_SCANTIME, 0, 40, 16 },
+	{ HID_DG_CONTACTCOUNT, 0, 56, 8 },
+	{ HID_UP_BUTTON | 1, 0, 64, 1 },
+	{ WH_HID, WH_INDEX, 80, 8 },
+};
 
-	app->timestamp = mt_compute_timestamp(app, *usages->scantime);
 
-	if (*usages->num_contacts == 1 && !*usages->touch && app->area > AREA_TRESHOLD) {
-		memcpy(app->delayed_state, app->hw_state, sizeof(app->hw_state));
-		mod_timer(&app->timer, jiffies + nsecs_to_jiffies(DELAY_NS));
-		set_bit(DELAYED_FLAG_PENDING, &app->delayed_flags);
-#ifdef MEASURE_TIME
-		printk("Timer started\n");
-		start_j = jiffies;
-#endif
-	} else {
-		send_report(app, 0);
+static bool elan_raw_usage_valid(struct hid_report *report,
+				const struct elan_raw_usage *u)
+{
+	struct hid_field *f;
+	int i, j;
+
+	for (i = 0; i < report->maxfield; i++) {
+		f = report->field[i];
+		if (!(f->flags & HID_MAIN_ITEM_VARIABLE))
+			continue;
+		for (j = 0; j < f->maxusage; j++) {
+			if (f->usage[j].hid != u->hid || f->usage[j].usage_index != u->index)
+				continue;
+			return f->report_offset + u->index * f->report_size == u->offset &&
+			       f->report_size >= u->bits &&
+			       f->logical_minimum >= 0 &&
+			       f->logical_maximum < (1 << u->bits);
+		}
 	}
+	return false;
 }
 
 
-static void elan_report(struct hid_device *hdev, struct hid_report *report)
+static bool elan_raw_layout_valid(struct hid_device *hdev)
+{
+	struct hid_report *report;
+	int i;
+
+	report = hdev->report_enum[HID_INPUT_REPORT].report_id_hash[ELAN_REPORT_ID];
+	if (!report || report->size != ELAN_REPORT_SIZE_BITS)
+		return false;
+
+	for (i = 0; i < ARRAY_SIZE(elan_raw_layout); i++) {
+		if (!elan_raw_usage_valid(report, &elan_raw_layout[i]))
+			return false;
+	}
+	return true;
+}
+
+
+// the fast path for the touch report, it's decoded here by the same
+// code as in the userspace driver instead of splitting it into fields
+// and passing every usage to elan_event
+static int elan_raw_event(struct hid_device *hdev, struct hid_report *report,
+			u8 *data, int size)
 {
-	struct hid_field *field = report->field[0];
 	struct elan_device *td = hid_get_drvdata(hdev);
+	struct elan_contact_report r;
 
-	if (!(hdev->claimed & HID_CLAIMED_INPUT))
-		return;
+	if (!td->raw_reports || report->id != ELAN_REPORT_ID ||
+	    size != ELAN_REPORT_SIZE || !(hdev->claimed & HID_CLAIMED_INPUT))
+		return 0;
 
-	if (report->id == ELAN_REPORT_ID && report->size == ELAN_REPORT_SIZE_BITS)
-		return elan_touchpad_report(&td->app, &td->usages);
+	// hid-core doesn't see the report any more, pass it to hidraw
+	if (hdev->claimed & HID_CLAIMED_HIDRAW)
+		hidraw_report_event(hdev, data, size);
 
-	if (field && field->hidinput && field->hidinput->input)
-		input_sync(field->hidinput->input);
+	if (!elan_core_decode(data, size, &r))
+		elan_touchpad_report(&td->app, &r);
+
+	// a negative value stops hid-core from processing the report
+	return -1;
 }
 
 
@@ -311,7 +461,7 @@ static int elan_event(struct hid_device *hdev, struct hid_field *field,
 		if (usage->hid == WH_HID && usage->usage_index == WH_INDEX) {
 			width = value & 0x0f;
 			height = value >> 4;
-			td->app.area = width * height;
+			td->area = width * height;
 		}
 		return 1;
 	}
@@ -346,11 +496,13 @@ static int elan_input_mapping(struct hid_device *hdev, struct hid_input *hi,
 		case HID_GD_X:
 			code = ABS_MT_POSITION_X;
 			set_abs(hi->input, code, field);
+			td->app.core.x_max = field->logical_maximum;
 			td->usages.x = &field->value[usage->usage_index];
 			return 1;
 		case HID_GD_Y:
 			code = ABS_MT_POSITION_Y;
 			set_abs(hi->input, code, field);
+			td->app.core.y_max = field->logical_maximum;
 			td->usages.y = &field->value[usage->usage_index];
 			return 1;
 		}
@@ -380,7 +532,7 @@ static int elan_input_mapping(struct hid_device *hdev, struct hid_input *hi,
 		case HID_DG_SCANTIME:
 			input_set_capability(hi->input, EV_MSC, MSC_TIMESTAMP);
 			td->usages.scantime = &field->value[usage->usage_index];
-			td->app.scantime_logical_max = field->logical_maximum;
+			td->app.core.scantime_logical_max = field->logical_maximum;
 			return 1;
 		case HID_DG_CONTACTMAX:
 			return -1;
@@ -441,7 +593,7 @@ static int elan_input_configured(struct hid_device *hdev, struct hid_input *hi)
 		return 0;
 
 	__set_bit(INPUT_PROP_BUTTONPAD, input->propbit);
-	ret = input_mt_init_slots(input, MAX_CONTACTS, INPUT_MT_POINTER);
+	ret = input_mt_init_slots(input, ELAN_MAX_CONTACTS, INPUT_MT_POINTER);
 
 	if (ret)
 		return ret;
@@ -470,6 +622,24 @@ static void elan_feature_mapping(struct hid_device *hdev,
 }
 
 
+static bool elan_set_latency(struct hid_device *hdev, int mode)
+{
+	struct elan_device *td = hid_get_drvdata(hdev);
+	struct hid_report *r;
+	struct hid_report_enum *re;
+
+	if (td->features.latency_report_id < 0)
+		return false;
+	re = &(hdev->report_enum[HID_FEATURE_REPORT]);
+	r = re->report_id_hash[td->features.latency_report_id];
+	if (!r)
+		return false;
+	r->field[0]->value[td->features.latency_index] = mode;
+	hid_hw_request(hdev, r, HID_REQ_SET_REPORT);
+	return true;
+}
+
+
 static void elan_set_modes(struct hid_device *hdev)
 {
 	struct elan_device *td = hid_get_drvdata(hdev);
@@ -485,17 +655,113 @@ static void elan_set_modes(struct hid_device *hdev)
 		r->field[0]->value[td->features.inputmode_index] = INPUT_MODE_TOUCHPAD;
 		hid_hw_request(hdev, r, HID_REQ_SET_REPORT);
 	}
-	r = re->report_id_hash[td->features.latency_report_id];
-	if (r) {
-		r->field[0]->value[td->features.latency_index] = LATENCY_MODE_NORMAL;
-		hid_hw_request(hdev, r, HID_REQ_SET_REPORT);
+	elan_set_latency(hdev, LATENCY_MODE_NORMAL);
+}
+
+
+// the residency is counted when the device wakes up
+static void elan_set_idle(struct elan_device *td, bool idle, u64 now)
+{
+	struct elan_application *app = &td->app;
+	unsigned long flags;
+
+	if (!elan_set_latency(td->hdev, idle ? LATENCY_MODE_HIGH : LATENCY_MODE_NORMAL))
+		return;
+
+	spin_lock_irqsave(&app->lock, flags);
+	if (idle) {
+		app->counters.latency_high++;
+		app->idle_since = now;
+	} else {
+		app->counters.latency_normal++;
+		app->counters.idle_ns += now - app->idle_since;
 	}
+	WRITE_ONCE(app->idle, idle);
+	spin_unlock_irqrestore(&app->lock, flags);
+}
+
+
+// nothing is queued while the device is idle
+static void elan_idle_work(struct work_struct *work)
+{
+	struct elan_application *app = container_of(to_delayed_work(work),
+					struct elan_application, idle_work);
+	struct elan_device *td = container_of(app, struct elan_device, app);
+	u64 period = (u64)elan_idle_ms * NSEC_PER_MSEC;
+	u64 now = ktime_get_ns();
+	u64 report_time;
+	unsigned long flags;
+
+	spin_lock_irqsave(&app->lock, flags);
+	report_time = app->report_time;
+	spin_unlock_irqrestore(&app->lock, flags);
+
+	if (READ_ONCE(app->idle)) {
+		elan_set_idle(td, false, now);
+		if (period)
+			schedule_delayed_work(&app->idle_work,
+					      nsecs_to_jiffies(period));
+	} else if (period && now - report_time >= period) {
+		elan_set_idle(td, true, now);
+	} else if (period) {
+		// touched since the work was queued
+		schedule_delayed_work(&app->idle_work,
+				      nsecs_to_jiffies(report_time + period - now) + 1);
+	}
+}
+
+
+static struct dentry *elan_debugfs_root;
+
+static int elan_stats_show(struct seq_file *s, void *unused)
+{
+	struct elan_application *app = s->private;
+	struct elan_counters *c = &app->counters;
+
+	seq_printf(s, "reports: %lu\n", c->reports);
+	seq_printf(s, "frames: %lu\n", c->frames);
+	seq_printf(s, "releases_delayed: %lu\n", c->releases_delayed);
+	seq_printf(s, "releases_sent: %lu\n", c->releases_sent);
+	seq_printf(s, "releases_dropped: %lu\n", c->releases_dropped);
+	seq_printf(s, "frames_partial: %lu\n", c->frames_partial);
+	seq_printf(s, "reports_lost: %lu\n", c->reports_lost);
+	seq_printf(s, "latency_high: %lu\n", c->latency_high);
+	seq_printf(s, "latency_normal: %lu\n", c->latency_normal);
+	seq_printf(s, "idle_ms: %llu\n", div_u64(c->idle_ns, NSEC_PER_MSEC));
+	seq_printf(s, "delay_us: %u\n", app->core.est.delay_usec);
+	seq_printf(s, "scan_period_us: %u\n", app->core.est.scan_period_usec);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(elan_stats);
+
+static int elan_hold_show(struct seq_file *s, void *unused)
+{
+	struct elan_application *app = s->private;
+	int i;
+
+	for (i = 0; i < HOLD_BUCKETS - 1; i++)
+		seq_printf(s, "%6d-%-6d us: %lu\n", i * HOLD_BUCKET_USEC,
+			   (i + 1) * HOLD_BUCKET_USEC - 1, app->counters.hold[i]);
+	seq_printf(s, "%6d+       us: %lu\n", i * HOLD_BUCKET_USEC,
+		   app->counters.hold[i]);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(elan_hold);
+
+
+static void elan_debugfs_init(struct elan_device *td)
+{
+	td->debugfs = debugfs_create_dir(dev_name(&td->hdev->dev), elan_debugfs_root);
+	debugfs_create_file("stats", 0444, td->debugfs, &td->app, &elan_stats_fops);
+	debugfs_create_file("hold_histogram", 0444, td->debugfs, &td->app,
+			    &elan_hold_fops);
 }
 
 
 static int elan_probe(struct hid_device *hdev, const struct hid_device_id *id)
 {
 	int ret;
+	unsigned int idle_ms;
 	struct elan_device *td;
 
 	td = devm_kzalloc(&hdev->dev, sizeof(struct elan_device), GFP_KERNEL);
@@ -507,24 +773,41 @@ static int elan_probe(struct hid_device *hdev, const struct hid_device_id *id)
 	td->hdev = hdev;
 	hid_set_drvdata(hdev, td);
 
-	init_app_vars(&td->app);
+	spin_lock_init(&td->app.lock);
+	elan_core_init(&td->app.core, &elan_core_ops, &td->app, &elan_params);
+	td->app.id = hdev->id;
 	td->features.inputmode_report_id = -1;
 	td->features.latency_report_id = -1;
 
 	hdev->quirks |= HID_QUIRK_NO_INPUT_SYNC;
 	hdev->quirks |= HID_QUIRK_INPUT_PER_APP;
 
-	timer_setup(&td->app.timer, timer_thread, 0);
+	hrtimer_init(&td->app.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+	td->app.timer.function = timer_thread;
+	hrtimer_init(&td->app.sync_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+	td->app.sync_timer.function = sync_timer_thread;
+	hrtimer_init(&td->app.frame_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+	td->app.frame_timer.function = frame_timer_thread;
+	INIT_DELAYED_WORK(&td->app.idle_work, elan_idle_work);
 
 	ret = hid_parse(hdev);
 	if (ret != 0)
 		return ret;
 
+	td->raw_reports = elan_raw_layout_valid(hdev);
+	if (!td->raw_reports)
+		hid_info(hdev, "unexpected touch report layout, using generic parsing\n");
+
 	ret = hid_hw_start(hdev, HID_CONNECT_DEFAULT);
 	if (ret)
 		return ret;
 
 	elan_set_modes(hdev);
+	elan_debugfs_init(td);
+	// a touchpad which is never touched goes idle too
+	idle_ms = READ_ONCE(elan_idle_ms);
+	if (idle_ms)
+		schedule_delayed_work(&td->app.idle_work, msecs_to_jiffies(idle_ms));
 
 	return 0;
 }
@@ -533,7 +816,13 @@ static int elan_probe(struct hid_device *hdev, const struct hid_device_id *id)
 #ifdef CONFIG_PM
 static int elan_reset_resume(struct hid_device *hdev)
 {
+	struct elan_device *td = hid_get_drvdata(hdev);
+
+	cancel_delayed_work_sync(&td->app.idle_work);
 	elan_set_modes(hdev);
+	// the reset left the device in the normal mode
+	if (READ_ONCE(td->app.idle))
+		elan_set_idle(td, false, ktime_get_ns());
 	return 0;
 }
 
@@ -548,7 +837,17 @@ static int elan_resume(struct hid_device *hdev)
 static void elan_remove(struct hid_device *hdev)
 {
 	struct elan_device *td = hid_get_drvdata(hdev);
-	del_timer_sync(&td->app.timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&td->app.lock, flags);
+	td->app.removed = true;
+	spin_unlock_irqrestore(&td->app.lock, flags);
+	cancel_delayed_work_sync(&td->app.idle_work);
+
+	debugfs_remove_recursive(td->debugfs);
+	hrtimer_cancel(&td->app.timer);
+	hrtimer_cancel(&td->app.sync_timer);
+	hrtimer_cancel(&td->app.frame_timer);
 	hid_hw_stop(hdev);
 }
 
@@ -576,6 +875,7 @@ static struct hid_driver elan_driver = {
 	.input_mapped			= elan_input_mapped,
 	.input_configured		= elan_input_configured,
 	.usage_table			= elan_grabbed_usages,
+	.raw_event			= elan_raw_event,
 	.event				= elan_event,
 	.report				= elan_report,
 #ifdef CONFIG_PM
@@ -585,4 +885,24 @@ static struct hid_driver elan_driver = {
 };
 
 
-module_hid_driver(elan_driver);
+static int __init elan_init(void)
+{
+	int ret;
+
+	elan_debugfs_root = debugfs_create_dir("hid-elan1200", NULL);
+	ret = hid_register_driver(&elan_driver);
+	if (ret)
+		debugfs_remove_recursive(elan_debugfs_root);
+	return ret;
+}
+
+
+static void __exit elan_exit(void)
+{
+	hid_unregister_driver(&elan_driver);
+	debugfs_remove_recursive(elan_debugfs_root);
+}
+
+
+module_init(elan_init);
+module_exit(elan_exit);
@@ -0,0 +1,516 @@
+// gcc -O2 -o bench_elan1200 bench_elan1200.c
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+
+#include "../core/elan_core.h"
+#include "elan_uinput.h"
+#include "elan_rt.h"
+#include "elan_rdesc.h"
+
+
+#define FRAMES 100000
+#define RUNS 3
+// the memfd is rewound so it doesn't grow for the whole run
+#define MEMFD_REWIND_WRITES 1024
+// the timer rate of the jitter mode, the rate of the touchpad reports
+#define JITTER_RATE 125
+#define JITTER_MAX_SAMPLES 1000000
+// the timer of the coalesced frames, after those of the core
+#define COALESCE_TIMER ELAN_NUM_TIMERS
+#define NUM_TIMERS (ELAN_NUM_TIMERS + 1)
+
+// a finger in buf[9], the decoder treats values from 38 up as a palm
+#define FINGER_VENDOR 10
+#define PALM_VENDOR 60
+#define AREA_FINGER 0x22
+#define AREA_WIDE 0x55
+#define AREA_TAP 0x11
+
+// every touch ends after this many frames, alternately with a ghost
+// release which is followed by a re-touch and with a real one
+#define TOUCH_FRAMES 256
+// the last contact is a palm for a part of every period
+#define PALM_PERIOD 64
+#define PALM_FRAMES 8
+// the button is down for a part of every period
+#define BUTTON_PERIOD 128
+#define BUTTON_FRAMES 16
+
+enum sink {
+	SINK_NULL,
+	SINK_MEMFD,
+};
+
+struct trace {
+	uint8_t (*reports)[ELAN_REPORT_SIZE];
+	uint64_t *times;
+	int num_reports;
+	int num_frames;
+};
+
+struct bench {
+	struct elan_core core;
+	struct elan_uinput out;
+	uint64_t now;
+	uint64_t deadline[NUM_TIMERS];
+	uint64_t write_time;
+	int memfd;
+
+	uint64_t writes;
+	uint64_t bytes;
+};
+
+static const int default_rates[] = { 125, 1000, 8000 };
+#define NUM_DEFAULT_RATES (sizeof(default_rates) / sizeof(default_rates[0]))
+
+static int num_frames = FRAMES;
+static int only_contacts;
+static int only_rate;
+static enum sink sink = SINK_NULL;
+static int jitter_seconds;
+static int num_hogs;
+static int realtime;
+static int cpu = -1;
+static int coalesce_us;
+
+static struct elan_layout layout;
+static const struct elan_core_params params = {
+	.delay_percentile = ELAN_DELAY_PERCENTILE,
+	.delay_min_us = ELAN_DELAY_MIN_USEC,
+	.delay_max_us = ELAN_DELAY_MAX_USEC,
+};
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+
+static void put_report(uint8_t *buf, int slot, int touch, int x, int y,
+			int scantime, int num_contacts, int vendor, int btn,
+			int area)
+{
+	memset(buf, 0, ELAN_REPORT_SIZE);
+	buf[0] = ELAN_REPORT_ID;
+	buf[1] = (slot << 4) | (touch ? 3 : 1);
+	buf[2] = x & 0xff;
+	buf[3] = (x >> 8) & 0x0f;
+	buf[4] = y & 0xff;
+	buf[5] = (y >> 8) & 0x0f;
+	buf[6] = scantime & 0xff;
+	buf[7] = (scantime >> 8) & 0xff;
+	buf[8] = num_contacts;
+	buf[9] = (vendor << 1) | btn;
+	buf[11] = area;
+}
+
+
+// a touch of the contacts moving across the surface at the report rate,
+// all the reports of a frame arrive at once
+static int generate(struct trace *t, int contacts, int rate)
+{
+	uint64_t period = 1000000000ULL / rate;
+	int f, i, n = 0, phase, release, ghost;
+	int vendor, btn, area;
+
+	t->reports = malloc((size_t)num_frames * contacts * ELAN_REPORT_SIZE);
+	t->times = malloc((size_t)num_frames * contacts * sizeof(uint64_t));
+	if (!t->reports || !t->times)
+		return -1;
+
+	for (f = 0; f < num_frames; f++) {
+		phase = f % TOUCH_FRAMES;
+		release = phase == TOUCH_FRAMES - 1;
+		ghost = (f / TOUCH_FRAMES) & 1;
+		btn = f % BUTTON_PERIOD < BUTTON_FRAMES;
+
+		for (i = 0; i < contacts; i++) {
+			vendor = FINGER_VENDOR;
+			if (i == contacts - 1 && f % PALM_PERIOD < PALM_FRAMES)
+				vendor = PALM_VENDOR;
+			area = release ? (ghost ? AREA_WIDE : AREA_TAP) : AREA_FINGER;
+
+			t->times[n] = 1 + f * period;
+			put_report(t->reports[n++], i, !release,
+				300 + i * 500 + phase * 4, 400 + phase * 6,
+				(int)(f * period / 100000), i ? 0 : contacts,
+				vendor, btn, area);
+		}
+	}
+
+	t->num_reports = n;
+	t->num_frames = num_frames;
+	return 0;
+}
+
+
+static uint64_t bench_now(void *ctx)
+{
+	struct bench *b = ctx;
+	return b->now;
+}
+
+
+// the coalescing of the driver without the vsync hints
+static void bench_write(struct bench *b, const struct elan_frame *frame)
+{
+	ssize_t n;
+
+	if (frame)
+		n = elan_uinput_emit(&b->out, frame);
+	else if (!(n = elan_uinput_flush(&b->out)))
+		return;
+
+	b->write_time = b->now;
+	b->deadline[COALESCE_TIMER] = 0;
+	b->writes++;
+	if (n > 0)
+		b->bytes += n;
+	if (b->memfd >= 0 && !(b->writes % MEMFD_REWIND_WRITES))
+		lseek(b->memfd, 0, SEEK_SET);
+}
+
+
+static void bench_emit(void *ctx, const struct elan_frame *frame)
+{
+	struct bench *b = ctx;
+	uint64_t deadline = b->write_time + (uint64_t)coalesce_us * 1000;
+
+	if (!coalesce_us || !elan_uinput_motion_only(&b->out, frame)) {
+		bench_write(b, frame);
+		return;
+	}
+
+	elan_uinput_hold(&b->out, frame);
+	if (deadline <= b->now)
+		bench_write(b, NULL);
+	else if (!b->deadline[COALESCE_TIMER])
+		b->deadline[COALESCE_TIMER] = deadline;
+}
+
+
+static void bench_arm(void *ctx, enum elan_core_timer timer, uint64_t deadline)
+{
+	struct bench *b = ctx;
+	b->deadline[timer] = deadline;
+}
+
+
+static const struct elan_core_ops bench_ops = {
+	.now = bench_now,
+	.emit = bench_emit,
+	.arm = bench_arm,
+};
+
+
+// the timers run on the trace time like in a replay
+static void expire_until(struct bench *b, uint64_t time)
+{
+	int i, next;
+
+	for (;;) {
+		next = -1;
+		for (i = 0; i < NUM_TIMERS; i++) {
+			if (b->deadline[i] && b->deadline[i] <= time &&
+			    (next < 0 || b->deadline[i] < b->deadline[next]))
+				next = i;
+		}
+		if (next < 0)
+			break;
+		b->now = b->deadline[next];
+		b->deadline[next] = 0;
+		if (next == COALESCE_TIMER)
+			bench_write(b, NULL);
+		else
+			elan_core_timer(&b->core, next);
+	}
+	b->now = time;
+}
+
+
+static uint64_t run(struct bench *b, const struct trace *t, int fd)
+{
+	struct elan_contact_report r;
+	uint64_t start;
+	int i;
+
+	memset(b, 0, sizeof(*b));
+	b->memfd = sink == SINK_MEMFD ? fd : -1;
+	elan_core_init(&b->core, &bench_ops, b, &params);
+	elan_uinput_init(&b->out, fd);
+	if (b->memfd >= 0)
+		lseek(fd, 0, SEEK_SET);
+
+	start = now_ns();
+	for (i = 0; i < t->num_reports; i++) {
+		expire_until(b, t->times[i]);
+		if (!elan_layout_decode(&layout, t->reports[i], ELAN_REPORT_SIZE, &r))
+			elan_core_report(&b->core, &r);
+	}
+	expire_until(b, UINT64_MAX);
+	return now_ns() - start;
+}
+
+
+static int bench_case(int contacts, int rate, int fd)
+{
+	struct trace t;
+	struct bench b;
+	uint64_t ns, best = UINT64_MAX;
+	int i;
+
+	memset(&t, 0, sizeof(t));
+	if (generate(&t, contacts, rate) < 0) {
+		perror("Unable to generate the trace");
+		free(t.reports);
+		free(t.times);
+		return -1;
+	}
+
+	for (i = 0; i < RUNS; i++) {
+		ns = run(&b, &t, fd);
+		if (ns < best)
+			best = ns;
+	}
+
+	printf("%8d %8d %10d %10.1f %10.1f %10.3f\n", contacts, rate,
+		t.num_frames, (double)best / t.num_frames,
+		(double)b.bytes / t.num_frames, (double)b.writes / t.num_frames);
+
+	free(t.reports);
+	free(t.times);
+	return 0;
+}
+
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+static void hog(void)
+{
+	volatile uint64_t n = 0;
+
+	for (;;)
+		n++;
+}
+
+
+// how late a periodic timer at the report rate wakes the process up,
+// as the event loop of the driver is woken up by the reports
+static int jitter(int rate)
+{
+	struct itimerspec its;
+	uint64_t *late, period, start, expected, expirations, now, sum = 0;
+	pid_t hogs[num_hogs > 0 ? num_hogs : 1];
+	int fd, i, n = 0, max_samples, ret = -1;
+
+	max_samples = (int)((uint64_t)jitter_seconds * rate);
+	if (max_samples > JITTER_MAX_SAMPLES)
+		max_samples = JITTER_MAX_SAMPLES;
+	if (!(late = malloc(max_samples * sizeof(*late)))) {
+		perror("Unable to allocate the samples");
+		return -1;
+	}
+
+	if (elan_rt_setup(realtime, cpu) < 0) {
+		perror("Unable to set up the real-time mode");
+		free(late);
+		return -1;
+	}
+
+	// the hogs share the CPU of the process if it's pinned
+	for (i = 0; i < num_hogs; i++) {
+		if (!(hogs[i] = fork()))
+			hog();
+		if (hogs[i] < 0)
+			perror("Unable to start a CPU hog");
+	}
+
+	if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0) {
+		perror("Unable to create the timer");
+		goto out;
+	}
+
+	period = 1000000000ULL / rate;
+	start = now_ns() + period;
+	its.it_value.tv_sec = start / 1000000000;
+	its.it_value.tv_nsec = start % 1000000000;
+	its.it_interval.tv_sec = period / 1000000000;
+	its.it_interval.tv_nsec = period % 1000000000;
+	if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		perror("Unable to arm the timer");
+		goto out_fd;
+	}
+
+	expected = start;
+	while (n < max_samples) {
+		if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+			perror("Unable to read the timer");
+			goto out_fd;
+		}
+		now = now_ns();
+		// the lateness of the last expiration, missed ones count as late
+		expected += (expirations - 1) * period;
+		late[n] = now - expected;
+		sum += late[n++];
+		expected += period;
+	}
+
+	qsort(late, n, sizeof(*late), compare_u64);
+	printf("%8s %8s %8s %10s %10s %10s %10s %10s\n", "rate", "hogs",
+		"samples", "mean us", "p50 us", "p99 us", "p99.9 us", "max us");
+	printf("%8d %8d %8d %10.1f %10.1f %10.1f %10.1f %10.1f\n", rate,
+		num_hogs, n, sum / 1000.0 / n, late[n / 2] / 1000.0,
+		late[(int)(n * 0.99)] / 1000.0, late[(int)(n * 0.999)] / 1000.0,
+		late[n - 1] / 1000.0);
+	ret = 0;
+
+out_fd:
+	close(fd);
+out:
+	for (i = 0; i < num_hogs; i++) {
+		if (hogs[i] > 0) {
+			kill(hogs[i], SIGKILL);
+			waitpid(hogs[i], NULL, 0);
+		}
+	}
+	free(late);
+	return ret;
+}
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		"  -n, --frames N     frames per case (%d)\n"
+		"  -c, --contacts N   only the cases with N contacts\n"
+		"  -r, --rate HZ      only this report rate\n"
+		"  -s, --sink SINK    null or memfd (null)\n"
+		"  -i, --coalesce US  merge the frames which only move the "
+		"contacts for US\n"
+		"  -j, --jitter SEC   measure the timer wakeup lateness instead, "
+		"at %d Hz or the rate\n"
+		"  -H, --hogs N       with N busy processes\n"
+		"  -t, --realtime[=PRIO]  with SCHED_FIFO priority (%d) "
+		"and locked memory\n"
+		"  -C, --cpu N        on CPU N\n",
+		name, FRAMES, JITTER_RATE, ELAN_RT_PRIORITY);
+}
+
+
+int main(int argc, char **argv)
+{
+	static const struct option options[] = {
+		{ "frames", required_argument, 0, 'n' },
+		{ "contacts", required_argument, 0, 'c' },
+		{ "rate", required_argument, 0, 'r' },
+		{ "sink", required_argument, 0, 's' },
+		{ "coalesce", required_argument, 0, 'i' },
+		{ "jitter", required_argument, 0, 'j' },
+		{ "hogs", required_argument, 0, 'H' },
+		{ "realtime", optional_argument, 0, 't' },
+		{ "cpu", required_argument, 0, 'C' },
+		{ "help", no_argument, 0, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+	int opt, fd, contacts, i;
+	int ret = 0;
+
+	while ((opt = getopt_long(argc, argv, "n:c:r:s:i:j:H:t::C:h", options, NULL)) != -1) {
+		switch (opt) {
+		case 'n':
+			num_frames = atoi(optarg);
+			break;
+		case 'c':
+			only_contacts = atoi(optarg);
+			break;
+		case 'r':
+			only_rate = atoi(optarg);
+			break;
+		case 's':
+			if (!strcmp(optarg, "null"))
+				sink = SINK_NULL;
+			else if (!strcmp(optarg, "memfd"))
+				sink = SINK_MEMFD;
+			else
+				sink = -1;
+			break;
+		case 'i':
+			coalesce_us = atoi(optarg);
+			break;
+		case 'j':
+			jitter_seconds = atoi(optarg);
+			break;
+		case 'H':
+			num_hogs = atoi(optarg);
+			break;
+		case 't':
+			realtime = optarg ? atoi(optarg) : ELAN_RT_PRIORITY;
+			break;
+		case 'C':
+			cpu = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (num_frames < 1 || only_contacts < 0 || only_contacts > ELAN_MAX_CONTACTS ||
+	    only_rate < 0 || only_rate > 1000000000 || (int)sink < 0 ||
+	    coalesce_us < 0 ||
+	    jitter_seconds < 0 || num_hogs < 0 || num_hogs > 1024 ||
+	    realtime < 0 || realtime > 99) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	elan_layout_default(&layout);
+
+	if (jitter_seconds)
+		return jitter(only_rate ? only_rate : JITTER_RATE) ? 1 : 0;
+
+	if (sink == SINK_MEMFD)
+		fd = memfd_create("elan1200-bench", MFD_CLOEXEC);
+	else
+		fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror("Unable to open the sink");
+		return 1;
+	}
+
+	printf("%8s %8s %10s %10s %10s %10s\n", "contacts", "rate", "frames",
+		"ns/frame", "B/frame", "sys/frame");
+	for (contacts = 1; contacts <= ELAN_MAX_CONTACTS && !ret; contacts++) {
+		if (only_contacts && contacts != only_contacts)
+			continue;
+		if (only_rate) {
+			ret = bench_case(contacts, only_rate, fd);
+			continue;
+		}
+		for (i = 0; i < (int)NUM_DEFAULT_RATES && !ret; i++)
+			ret = bench_case(contacts, default_rates[i], fd);
+	}
+
+	close(fd);
+	return ret ? 1 : 0;
+}
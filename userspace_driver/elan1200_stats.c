@@ -0,0 +1,216 @@
+// gcc -o elan1200_stats elan1200_stats.c -lrt
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "elan_stats.h"
+
+
+static const char *hist_names[ELAN_NUM_HISTS] = {
+	[ELAN_HIST_LATENCY] = "read to write latency",
+	[ELAN_HIST_HOLD] = "delayed release hold",
+	[ELAN_HIST_INTERVAL] = "report interval",
+};
+
+static const char *counter_names[ELAN_NUM_COUNTERS] = {
+	[ELAN_CNT_REPORTS] = "reports",
+	[ELAN_CNT_FRAMES] = "frames",
+	[ELAN_CNT_WRITES] = "uinput writes",
+	[ELAN_CNT_RELEASES_DELAYED] = "releases delayed",
+	[ELAN_CNT_RELEASES_SENT] = "delayed releases sent",
+	[ELAN_CNT_RELEASES_DROPPED] = "delayed releases dropped",
+	[ELAN_CNT_LATENCY_HIGH] = "idle mode entered",
+	[ELAN_CNT_LATENCY_NORMAL] = "idle mode left",
+	[ELAN_CNT_IDLE_MS] = "idle ms",
+	[ELAN_CNT_FRAMES_PARTIAL] = "partial frames",
+	[ELAN_CNT_REPORTS_LOST] = "reports lost",
+	[ELAN_CNT_FRAMES_COALESCED] = "frames coalesced",
+};
+
+#define PARAM(name) { #name, offsetof(struct elan_core_params, name) }
+
+static const struct {
+	const char *name;
+	size_t offset;
+} param_names[] = {
+	PARAM(delay_percentile),
+	PARAM(delay_min_us),
+	PARAM(delay_max_us),
+	PARAM(predict_us),
+	PARAM(predict_max),
+	PARAM(smooth_cutoff_mhz),
+	PARAM(smooth_beta),
+	PARAM(smooth_hysteresis),
+};
+#define NUM_PARAMS (sizeof(param_names) / sizeof(param_names[0]))
+
+static const double percentiles[] = { 50, 90, 99, 99.9 };
+#define NUM_PERCENTILES (sizeof(percentiles) / sizeof(percentiles[0]))
+
+
+static void print_usec(uint64_t ns)
+{
+	printf(" %10.1f", ns / 1000.0);
+}
+
+
+static void print_hist(const char *name, struct elan_hist *h)
+{
+	uint64_t buckets[ELAN_HIST_BUCKETS];
+	uint64_t count = 0, sum = 0, target, bound;
+	uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+	unsigned int p;
+	int i = 0;
+
+	// take a copy, the driver keeps updating the histogram
+	for (i = 0; i < ELAN_HIST_BUCKETS; i++) {
+		buckets[i] = atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+		count += buckets[i];
+	}
+
+	printf("%-24s %10lu", name, count);
+	if (!count) {
+		printf("\n");
+		return;
+	}
+
+	print_usec(atomic_load_explicit(&h->sum, memory_order_relaxed) / count);
+
+	// report the upper bound of the bucket holding the percentile,
+	// the buckets are within 25% of their values
+	i = 0;
+	for (p = 0; p < NUM_PERCENTILES; p++) {
+		target = count * percentiles[p] / 100;
+		for (; i < ELAN_HIST_BUCKETS - 1; i++) {
+			if (sum + buckets[i] > target)
+				break;
+			sum += buckets[i];
+		}
+		bound = elan_hist_bucket_min(i + 1) - 1;
+		print_usec(bound < max ? bound : max);
+	}
+
+	print_usec(max);
+	printf("\n");
+}
+
+
+static volatile unsigned int *param(struct elan_stats *stats, int i)
+{
+	return (volatile unsigned int *)((char *)&stats->params +
+					 param_names[i].offset);
+}
+
+
+// the driver reads the parameter on its next use
+static int set_param(struct elan_stats *stats, const char *arg)
+{
+	const char *value = strchr(arg, '=');
+	unsigned int i;
+
+	for (i = 0; value && i < NUM_PARAMS; i++) {
+		if (strlen(param_names[i].name) == (size_t)(value - arg) &&
+		    !strncmp(param_names[i].name, arg, value - arg)) {
+			*param(stats, i) = strtoul(value + 1, NULL, 0);
+			return 0;
+		}
+	}
+	fprintf(stderr, "Unknown parameter %s, the parameters are:", arg);
+	for (i = 0; i < NUM_PARAMS; i++)
+		fprintf(stderr, " %s", param_names[i].name);
+	fprintf(stderr, "\n");
+	return -1;
+}
+
+
+static void print_stats(struct elan_stats *stats)
+{
+	unsigned int i;
+
+	for (i = 0; i < ELAN_NUM_COUNTERS; i++)
+		printf("%-24s %10lu\n", counter_names[i],
+			atomic_load_explicit(&stats->counters[i], memory_order_relaxed));
+
+	printf("\n");
+	for (i = 0; i < NUM_PARAMS; i++)
+		printf("%-24s %10u\n", param_names[i].name, *param(stats, i));
+
+	printf("\n%-24s %10s %10s %10s %10s %10s %10s %10s\n", "us", "count",
+		"mean", "p50", "p90", "p99", "p99.9", "max");
+	for (i = 0; i < ELAN_NUM_HISTS; i++)
+		print_hist(hist_names[i], &stats->hists[i]);
+}
+
+
+int main(int argc, char **argv)
+{
+	struct elan_stats *stats;
+	const char *assignments[NUM_PARAMS];
+	int num_assignments = 0;
+	int interval = 0;
+	int fd, opt, i;
+
+	while ((opt = getopt(argc, argv, "i:s:h")) != -1) {
+		switch (opt) {
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 's':
+			if (num_assignments < (int)NUM_PARAMS) {
+				assignments[num_assignments++] = optarg;
+				break;
+			}
+			// fall through
+		default:
+			fprintf(stderr, "Usage: %s [-i SECONDS] [-s NAME=VALUE]...\n",
+				argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if ((fd = shm_open(ELAN_STATS_NAME, num_assignments ? O_RDWR : O_RDONLY,
+			   0)) < 0) {
+		perror("The driver isn't running");
+		return 1;
+	}
+	stats = mmap(NULL, sizeof(*stats),
+		     num_assignments ? PROT_READ | PROT_WRITE : PROT_READ,
+		     MAP_SHARED, fd, 0);
+	close(fd);
+	if (stats == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	if (stats->magic != ELAN_STATS_MAGIC ||
+	    stats->version != ELAN_STATS_VERSION ||
+	    stats->size != sizeof(*stats)) {
+		fprintf(stderr, "The driver publishes a different format.\n");
+		return 1;
+	}
+
+	for (i = 0; i < num_assignments; i++) {
+		if (set_param(stats, assignments[i]) < 0)
+			return 1;
+	}
+
+	for (;;) {
+		print_stats(stats);
+		if (!interval)
+			break;
+		sleep(interval);
+		printf("\n");
+	}
+
+	munmap(stats, sizeof(*stats));
+	return 0;
+}
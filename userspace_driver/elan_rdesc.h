@@ -0,0 +1,436 @@
+/*
+ * The touch report layout read from the HID report descriptor.
+ *
+ * The descriptor is parsed once into a flat table of the bit offset,
+ * the size and the logical range of every field the driver uses, the
+ * decoder only extracts bits at the offsets of the table.
+ *
+ * The vendor data isn't described by the descriptor: the palm value
+ * hides in the padding after the button and the contact area is the
+ * second byte of the vendor usage 0xC5. The ghost release filter
+ * depends on both, a descriptor without them isn't accepted.
+ */
+
+#ifndef ELAN_RDESC_H
+#define ELAN_RDESC_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "../core/elan_core.h"
+
+#define ELAN_RDESC_MAX_USAGES 16
+#define ELAN_RDESC_STACK_DEPTH 4
+#define ELAN_RDESC_MAX_REPORT_IDS 256
+
+// the palm value, from this one up the contact is a palm
+#define ELAN_PALM_VALUE 38
+
+#define HID_UP_GENERIC_DESKTOP 0x01
+#define HID_UP_BUTTON 0x09
+#define HID_UP_DIGITIZER 0x0d
+
+#define HID_USAGE(page, id) (((uint32_t)(page) << 16) | (id))
+#define HID_USAGE_TOUCHPAD HID_USAGE(HID_UP_DIGITIZER, 0x05)
+#define HID_USAGE_TIP_SWITCH HID_USAGE(HID_UP_DIGITIZER, 0x42)
+#define HID_USAGE_CONFIDENCE HID_USAGE(HID_UP_DIGITIZER, 0x47)
+#define HID_USAGE_CONTACT_ID HID_USAGE(HID_UP_DIGITIZER, 0x51)
+#define HID_USAGE_CONTACT_COUNT HID_USAGE(HID_UP_DIGITIZER, 0x54)
+#define HID_USAGE_SCAN_TIME HID_USAGE(HID_UP_DIGITIZER, 0x56)
+#define HID_USAGE_X HID_USAGE(HID_UP_GENERIC_DESKTOP, 0x30)
+#define HID_USAGE_Y HID_USAGE(HID_UP_GENERIC_DESKTOP, 0x31)
+#define HID_USAGE_BUTTON_1 HID_USAGE(HID_UP_BUTTON, 0x01)
+#define HID_USAGE_ID_VENDOR_AREA 0xc5
+
+enum elan_field {
+	ELAN_FIELD_CONFIDENCE,
+	ELAN_FIELD_TIP,
+	ELAN_FIELD_CONTACT_ID,
+	ELAN_FIELD_X,
+	ELAN_FIELD_Y,
+	ELAN_FIELD_SCAN_TIME,
+	ELAN_FIELD_CONTACT_COUNT,
+	ELAN_FIELD_BUTTON,
+	ELAN_FIELD_PALM,
+	ELAN_FIELD_AREA,
+	ELAN_NUM_FIELDS
+};
+
+// a size of zero marks a field the report doesn't have
+struct elan_field_info {
+	int offset;
+	int size;
+	int32_t logical_min;
+	int32_t logical_max;
+	// units per mm, zero when unknown
+	int resolution;
+};
+
+struct elan_layout {
+	int report_id;
+	// in bytes, with the report ID
+	int report_size;
+	struct elan_field_info fields[ELAN_NUM_FIELDS];
+};
+
+struct elan_rdesc_globals {
+	uint32_t usage_page;
+	int32_t logical_min, logical_max;
+	int32_t physical_min, physical_max;
+	int unit_exponent;
+	uint32_t unit;
+	int report_size;
+	int report_id;
+	int report_count;
+};
+
+
+// the bits above the logical maximum carry no data on the ELAN1200
+static inline void elan_field_trim(struct elan_field_info *f)
+{
+	int bits = 1;
+
+	if (f->logical_min < 0 || f->logical_max <= 0)
+		return;
+	while (bits < 32 && (uint32_t)f->logical_max >> bits)
+		bits++;
+	if (bits < f->size)
+		f->size = bits;
+}
+
+
+static inline void elan_layout_trim(struct elan_layout *l)
+{
+	elan_field_trim(&l->fields[ELAN_FIELD_X]);
+	elan_field_trim(&l->fields[ELAN_FIELD_Y]);
+}
+
+
+// the layout of the ELAN1200 firmware the driver was written for, used
+// for traces and when the descriptor can't be read
+static inline void elan_layout_default(struct elan_layout *l)
+{
+	static const struct elan_field_info fields[ELAN_NUM_FIELDS] = {
+		[ELAN_FIELD_CONFIDENCE] = { 0, 1, 0, 1, 0 },
+		[ELAN_FIELD_TIP] = { 1, 1, 0, 1, 0 },
+		[ELAN_FIELD_CONTACT_ID] = { 4, 4, 0, 15, 0 },
+		[ELAN_FIELD_X] = { 8, 16, 0, 3200, 31 },
+		[ELAN_FIELD_Y] = { 24, 16, 0, 2198, 31 },
+		[ELAN_FIELD_SCAN_TIME] = { 40, 16, 0, 65535, 0 },
+		[ELAN_FIELD_CONTACT_COUNT] = { 56, 8, 0, 127, 0 },
+		[ELAN_FIELD_BUTTON] = { 64, 1, 0, 1, 0 },
+		[ELAN_FIELD_PALM] = { 65, 7, 0, 1, 0 },
+		[ELAN_FIELD_AREA] = { 80, 8, 0, 255, 0 },
+	};
+
+	l->report_id = ELAN_REPORT_ID;
+	l->report_size = ELAN_REPORT_SIZE;
+	memcpy(l->fields, fields, sizeof(fields));
+	elan_layout_trim(l);
+}
+
+
+static inline int32_t elan_rdesc_signed(uint32_t value, int size)
+{
+	if (size == 1)
+		return (int8_t)value;
+	if (size == 2)
+		return (int16_t)value;
+	return (int32_t)value;
+}
+
+
+// the unit exponent is a 4 bit two's complement value
+static inline int elan_rdesc_exponent(uint32_t value)
+{
+	if (value < 16)
+		return value > 7 ? (int)value - 16 : (int)value;
+	return (int32_t)value;
+}
+
+
+// units per mm like the input core computes them, for cm and inch
+static inline int elan_rdesc_resolution(const struct elan_rdesc_globals *g)
+{
+	double physical = g->physical_max - g->physical_min;
+	int exponent = g->unit_exponent;
+
+	if (physical <= 0)
+		return 0;
+	if (g->unit == 0x11)
+		exponent += 1;
+	else if (g->unit == 0x13)
+		physical *= 25.4;
+	else
+		return 0;
+
+	for (; exponent > 0; exponent--)
+		physical *= 10;
+	for (; exponent < 0; exponent++)
+		physical /= 10;
+	return (int)((g->logical_max - g->logical_min) / physical + 0.5);
+}
+
+
+static inline int elan_rdesc_field(uint32_t usage)
+{
+	switch (usage) {
+	case HID_USAGE_CONFIDENCE:
+		return ELAN_FIELD_CONFIDENCE;
+	case HID_USAGE_TIP_SWITCH:
+		return ELAN_FIELD_TIP;
+	case HID_USAGE_CONTACT_ID:
+		return ELAN_FIELD_CONTACT_ID;
+	case HID_USAGE_X:
+		return ELAN_FIELD_X;
+	case HID_USAGE_Y:
+		return ELAN_FIELD_Y;
+	case HID_USAGE_SCAN_TIME:
+		return ELAN_FIELD_SCAN_TIME;
+	case HID_USAGE_CONTACT_COUNT:
+		return ELAN_FIELD_CONTACT_COUNT;
+	case HID_USAGE_BUTTON_1:
+		return ELAN_FIELD_BUTTON;
+	}
+	return -1;
+}
+
+
+static inline void elan_rdesc_set(struct elan_field_info *f, int offset,
+				const struct elan_rdesc_globals *g)
+{
+	// only the first contact of a report is used
+	if (f->size)
+		return;
+	f->offset = offset;
+	f->size = g->report_size;
+	f->logical_min = g->logical_min;
+	f->logical_max = g->logical_max;
+	f->resolution = elan_rdesc_resolution(g);
+}
+
+
+// the fields of an input item of the touch report
+static inline void elan_rdesc_input(struct elan_layout *l,
+				const struct elan_rdesc_globals *g,
+				uint32_t flags, const uint32_t *usages,
+				int num_usages, int offset, int *after_button)
+{
+	struct elan_rdesc_globals padding;
+	uint32_t usage;
+	int i, field;
+
+	// constant, the padding after the button is the vendor palm value
+	if (flags & 0x01 || !num_usages) {
+		if (*after_button) {
+			padding = *g;
+			padding.report_size *= g->report_count;
+			elan_rdesc_set(&l->fields[ELAN_FIELD_PALM], offset, &padding);
+		}
+		*after_button = 0;
+		return;
+	}
+
+	for (i = 0; i < g->report_count; i++) {
+		// the last usage repeats for the remaining values
+		usage = usages[i < num_usages ? i : num_usages - 1];
+		field = elan_rdesc_field(usage);
+		if ((usage & 0xffff) == HID_USAGE_ID_VENDOR_AREA && i == 1)
+			field = ELAN_FIELD_AREA;
+		if (field < 0)
+			continue;
+		elan_rdesc_set(&l->fields[field], offset + i * g->report_size, g);
+		l->report_id = g->report_id;
+	}
+	*after_button = usages[num_usages - 1] == HID_USAGE_BUTTON_1;
+}
+
+
+// returns 0 when an input report of a touch pad collection with the
+// contact position, the palm value and the contact area was found
+static inline int elan_rdesc_parse(const uint8_t *desc, int len,
+				struct elan_layout *l)
+{
+	struct elan_rdesc_globals g, stack[ELAN_RDESC_STACK_DEPTH];
+	uint32_t usages[ELAN_RDESC_MAX_USAGES];
+	uint32_t application = 0, value, usage_min = 0;
+	uint16_t bits[ELAN_RDESC_MAX_REPORT_IDS];
+	int num_usages = 0, depth = 0, sp = 0;
+	int after_button = 0;
+	int pos = 0, size, type, tag, i;
+	int32_t svalue;
+
+	memset(&g, 0, sizeof(g));
+	memset(bits, 0, sizeof(bits));
+	memset(l, 0, sizeof(*l));
+
+	while (pos < len) {
+		// long items carry nothing the driver uses
+		if (desc[pos] == 0xfe) {
+			if (pos + 1 >= len)
+				return -1;
+			pos += 3 + desc[pos + 1];
+			continue;
+		}
+
+		size = desc[pos] & 0x03;
+		if (size == 3)
+			size = 4;
+		type = (desc[pos] >> 2) & 0x03;
+		tag = desc[pos] >> 4;
+		if (pos + 1 + size > len)
+			return -1;
+		value = 0;
+		for (i = 0; i < size; i++)
+			value |= (uint32_t)desc[pos + 1 + i] << (8 * i);
+		svalue = elan_rdesc_signed(value, size);
+		pos += 1 + size;
+
+		switch (type) {
+		// main
+		case 0:
+			if (tag == 0xa) {
+				if (!depth++ && num_usages)
+					application = usages[0];
+			} else if (tag == 0xc) {
+				if (depth && !--depth)
+					application = 0;
+			} else if (tag == 0x8) {
+				if (application == HID_USAGE_TOUCHPAD &&
+				    (!l->report_id || l->report_id == g.report_id))
+					elan_rdesc_input(l, &g, value, usages,
+							num_usages, bits[g.report_id],
+							&after_button);
+				bits[g.report_id] += g.report_size * g.report_count;
+			}
+			num_usages = 0;
+			break;
+		// global
+		case 1:
+			switch (tag) {
+			case 0x0:
+				g.usage_page = value;
+				break;
+			case 0x1:
+				g.logical_min = svalue;
+				break;
+			case 0x2:
+				g.logical_max = g.logical_min < 0 ? svalue : (int32_t)value;
+				break;
+			case 0x3:
+				g.physical_min = svalue;
+				break;
+			case 0x4:
+				g.physical_max = g.physical_min < 0 ? svalue : (int32_t)value;
+				break;
+			case 0x5:
+				g.unit_exponent = elan_rdesc_exponent(value);
+				break;
+			case 0x6:
+				g.unit = value;
+				break;
+			case 0x7:
+				g.report_size = value;
+				break;
+			case 0x8:
+				if (value >= ELAN_RDESC_MAX_REPORT_IDS)
+					return -1;
+				g.report_id = value;
+				break;
+			case 0x9:
+				g.report_count = value;
+				break;
+			case 0xa:
+				if (sp == ELAN_RDESC_STACK_DEPTH)
+					return -1;
+				stack[sp++] = g;
+				break;
+			case 0xb:
+				if (!sp)
+					return -1;
+				g = stack[--sp];
+				break;
+			}
+			break;
+		// local
+		case 2:
+			// a usage without a page is on the current one
+			if (size < 4)
+				value |= g.usage_page << 16;
+			if (tag == 0x0 && num_usages < ELAN_RDESC_MAX_USAGES) {
+				usages[num_usages++] = value;
+			} else if (tag == 0x1) {
+				usage_min = value;
+			} else if (tag == 0x2) {
+				for (; usage_min <= value &&
+				       num_usages < ELAN_RDESC_MAX_USAGES; usage_min++)
+					usages[num_usages++] = usage_min;
+			}
+			break;
+		}
+	}
+
+	if (!l->fields[ELAN_FIELD_X].size || !l->fields[ELAN_FIELD_Y].size ||
+	    !l->fields[ELAN_FIELD_TIP].size || !l->fields[ELAN_FIELD_PALM].size ||
+	    !l->fields[ELAN_FIELD_AREA].size)
+		return -1;
+	l->report_size = (bits[l->report_id] + 7) / 8 + (l->report_id ? 1 : 0);
+	elan_layout_trim(l);
+	return 0;
+}
+
+
+// the report ID byte isn't counted in the offsets
+static inline uint32_t elan_field_get(const uint8_t *buf,
+				const struct elan_field_info *f, int id_size)
+{
+	uint32_t value = 0;
+	int first = id_size + f->offset / 8;
+	int last = id_size + (f->offset + f->size - 1) / 8;
+
+	for (int i = last; i >= first; i--)
+		value = (value << 8) | buf[i];
+	value >>= f->offset % 8;
+	if (f->size < 32)
+		value &= (1U << f->size) - 1;
+	return value;
+}
+
+
+// the same checks and values as elan_core_decode() for any layout,
+// returns 0 when the report is valid
+static inline int elan_layout_decode(const struct elan_layout *l,
+				const uint8_t *buf, int size,
+				struct elan_contact_report *r)
+{
+	const struct elan_field_info *f = l->fields;
+	int id_size = l->report_id ? 1 : 0;
+	uint32_t area;
+
+	if (size != l->report_size || (id_size && buf[0] != l->report_id))
+		return -1;
+
+	// not confident, e.g. the 0x40 event
+	if (f[ELAN_FIELD_CONFIDENCE].size &&
+	    !elan_field_get(buf, &f[ELAN_FIELD_CONFIDENCE], id_size))
+		return -1;
+
+	r->slot = f[ELAN_FIELD_CONTACT_ID].size ?
+		elan_field_get(buf, &f[ELAN_FIELD_CONTACT_ID], id_size) : 0;
+	r->touch = elan_field_get(buf, &f[ELAN_FIELD_TIP], id_size);
+	r->x = elan_field_get(buf, &f[ELAN_FIELD_X], id_size);
+	r->y = elan_field_get(buf, &f[ELAN_FIELD_Y], id_size);
+	r->scantime = f[ELAN_FIELD_SCAN_TIME].size ?
+		elan_field_get(buf, &f[ELAN_FIELD_SCAN_TIME], id_size) : 0;
+	r->num_contacts = f[ELAN_FIELD_CONTACT_COUNT].size ?
+		elan_field_get(buf, &f[ELAN_FIELD_CONTACT_COUNT], id_size) : 0;
+	r->btn_left = f[ELAN_FIELD_BUTTON].size ?
+		elan_field_get(buf, &f[ELAN_FIELD_BUTTON], id_size) : 0;
+	r->tool = elan_field_get(buf, &f[ELAN_FIELD_PALM], id_size) < ELAN_PALM_VALUE;
+
+	area = elan_field_get(buf, &f[ELAN_FIELD_AREA], id_size);
+	r->area = (area & 0x0f) * (area >> 4);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,56 @@
+/*
+ * The low-jitter mode: a real-time priority, the memory locked and
+ * prefaulted so no page faults happen in the event loop, optionally
+ * pinned to one CPU.
+ */
+
+#ifndef ELAN_RT_H
+#define ELAN_RT_H
+
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define ELAN_RT_PRIORITY 40
+// the stack the event loop may use
+#define ELAN_RT_STACK_SIZE (128 * 1024)
+
+
+static void __attribute__((noinline)) elan_rt_prefault_stack(void)
+{
+	unsigned char stack[ELAN_RT_STACK_SIZE];
+
+	memset(stack, 0, sizeof(stack));
+	// the writes must not be optimized out
+	__asm__ __volatile__("" : : "r"(stack) : "memory");
+}
+
+
+// a priority of zero keeps the scheduling policy, a negative cpu
+// keeps the affinity, returns -1 with errno on errors
+static inline int elan_rt_setup(int priority, int cpu)
+{
+	struct sched_param sp;
+	cpu_set_t set;
+
+	if (cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) < 0)
+			return -1;
+	}
+
+	if (priority <= 0)
+		return 0;
+
+	// the pages mapped from now on are locked as well
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+		return -1;
+	elan_rt_prefault_stack();
+
+	// children such as a CPU hog don't inherit the priority
+	sp.sched_priority = priority;
+	return sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &sp);
+}
+
+#endif
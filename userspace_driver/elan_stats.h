@@ -0,0 +1,131 @@
+/*
+ * Statistics of the userspace driver, published in a POSIX shared
+ * memory segment and read by elan1200_stats.
+ *
+ * The driver is the only writer, it updates the values with relaxed
+ * atomic stores, so recording costs a few plain memory accesses and
+ * readers never block it. A reader may see a histogram in the middle
+ * of an update, which is irrelevant for percentiles.
+ *
+ * The parameters of the core are in the segment too, the driver reads
+ * them on every use and elan1200_stats may change them.
+ */
+
+#ifndef ELAN_STATS_H
+#define ELAN_STATS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "../core/elan_core.h"
+
+#define ELAN_STATS_NAME "/elan1200-stats"
+#define ELAN_STATS_MAGIC 0x5354415453454c45ULL
+#define ELAN_STATS_VERSION 5
+
+// log-linear buckets: every power of two is split in four
+#define ELAN_HIST_SUB_BITS 2
+#define ELAN_HIST_BUCKETS 160
+
+enum elan_hist_id {
+	// hidraw read of the last report of a frame to the uinput write
+	ELAN_HIST_LATENCY,
+	// a release held by the filter until it's sent or dropped
+	ELAN_HIST_HOLD,
+	// between two consecutive touch reports
+	ELAN_HIST_INTERVAL,
+	ELAN_NUM_HISTS
+};
+
+enum elan_counter_id {
+	ELAN_CNT_REPORTS,
+	ELAN_CNT_FRAMES,
+	ELAN_CNT_WRITES,
+	ELAN_CNT_RELEASES_DELAYED,
+	ELAN_CNT_RELEASES_SENT,
+	ELAN_CNT_RELEASES_DROPPED,
+	// latency mode switches and the time spent idle
+	ELAN_CNT_LATENCY_HIGH,
+	ELAN_CNT_LATENCY_NORMAL,
+	ELAN_CNT_IDLE_MS,
+	// frames sent without some of their reports
+	ELAN_CNT_FRAMES_PARTIAL,
+	ELAN_CNT_REPORTS_LOST,
+	// frames merged into the write of a later one
+	ELAN_CNT_FRAMES_COALESCED,
+	ELAN_NUM_COUNTERS
+};
+
+struct elan_hist {
+	_Atomic uint64_t count;
+	_Atomic uint64_t sum;
+	_Atomic uint64_t max;
+	_Atomic uint64_t buckets[ELAN_HIST_BUCKETS];
+};
+
+struct elan_stats {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t size;
+	_Atomic uint64_t counters[ELAN_NUM_COUNTERS];
+	struct elan_hist hists[ELAN_NUM_HISTS];
+	struct elan_core_params params;
+};
+
+
+static inline int elan_hist_bucket(uint64_t v)
+{
+	int msb, i;
+
+	if (v < (1 << ELAN_HIST_SUB_BITS))
+		return v;
+	msb = 63 - __builtin_clzll(v);
+	i = ((msb - ELAN_HIST_SUB_BITS + 1) << ELAN_HIST_SUB_BITS) |
+		((v >> (msb - ELAN_HIST_SUB_BITS)) & ((1 << ELAN_HIST_SUB_BITS) - 1));
+	return i < ELAN_HIST_BUCKETS ? i : ELAN_HIST_BUCKETS - 1;
+}
+
+
+// the smallest value which falls into the bucket
+static inline uint64_t elan_hist_bucket_min(int i)
+{
+	int shift = (i >> ELAN_HIST_SUB_BITS) - 1;
+	uint64_t sub = i & ((1 << ELAN_HIST_SUB_BITS) - 1);
+
+	if (i < (1 << ELAN_HIST_SUB_BITS))
+		return i;
+	return ((1ULL << ELAN_HIST_SUB_BITS) | sub) << shift;
+}
+
+
+static inline void elan_stats_add(_Atomic uint64_t *v, uint64_t n)
+{
+	atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n,
+			memory_order_relaxed);
+}
+
+
+static inline void elan_stats_count(struct elan_stats *stats,
+				enum elan_counter_id id)
+{
+	if (stats)
+		elan_stats_add(&stats->counters[id], 1);
+}
+
+
+static inline void elan_stats_record(struct elan_stats *stats,
+				enum elan_hist_id id, uint64_t v)
+{
+	struct elan_hist *h;
+
+	if (!stats)
+		return;
+	h = &stats->hists[id];
+	elan_stats_add(&h->buckets[elan_hist_bucket(v)], 1);
+	elan_stats_add(&h->count, 1);
+	elan_stats_add(&h->sum, v);
+	if (v > atomic_load_explicit(&h->max, memory_order_relaxed))
+		atomic_store_explicit(&h->max, v, memory_order_relaxed);
+}
+
+#endif
@@ -0,0 +1,104 @@
+/*
+ * Trace of raw ELAN1200 touch reports as they are read from hidraw.
+ *
+ * The file starts with a header followed by fixed size records, all
+ * the integers are little-endian. Readers skip the record bytes they
+ * don't know about, so a record can grow in a later version.
+ */
+
+#ifndef ELAN_TRACE_H
+#define ELAN_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#define ELAN_TRACE_MAGIC "ELANTRC"
+#define ELAN_TRACE_VERSION 1
+#define ELAN_TRACE_REPORT_SIZE 14
+
+struct elan_trace_header {
+	char magic[8];
+	uint16_t version;
+	uint16_t header_size;
+	uint16_t record_size;
+	uint16_t report_size;
+} __attribute__((packed));
+
+struct elan_trace_record {
+	// CLOCK_MONOTONIC time of the read
+	uint64_t time_ns;
+	uint8_t report[ELAN_TRACE_REPORT_SIZE];
+} __attribute__((packed));
+
+
+static inline int elan_trace_write_header(FILE *f)
+{
+	struct elan_trace_header h;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, ELAN_TRACE_MAGIC, sizeof(ELAN_TRACE_MAGIC));
+	h.version = htole16(ELAN_TRACE_VERSION);
+	h.header_size = htole16(sizeof(h));
+	h.record_size = htole16(sizeof(struct elan_trace_record));
+	h.report_size = htole16(ELAN_TRACE_REPORT_SIZE);
+
+	return fwrite(&h, sizeof(h), 1, f) == 1 ? 0 : -1;
+}
+
+
+// returns the record size of the trace or -1
+static inline int elan_trace_read_header(FILE *f)
+{
+	struct elan_trace_header h;
+	int header_size, record_size;
+
+	if (fread(&h, sizeof(h), 1, f) != 1 ||
+	    memcmp(h.magic, ELAN_TRACE_MAGIC, sizeof(ELAN_TRACE_MAGIC)) ||
+	    le16toh(h.version) < 1 ||
+	    le16toh(h.report_size) != ELAN_TRACE_REPORT_SIZE)
+		return -1;
+
+	header_size = le16toh(h.header_size);
+	record_size = le16toh(h.record_size);
+	if (header_size < (int)sizeof(h) ||
+	    record_size < (int)sizeof(struct elan_trace_record))
+		return -1;
+
+	if (fseek(f, header_size - sizeof(h), SEEK_CUR) < 0)
+		return -1;
+	return record_size;
+}
+
+
+static inline int elan_trace_write(FILE *f, uint64_t time_ns,
+				const unsigned char *report)
+{
+	struct elan_trace_record r;
+
+	r.time_ns = htole64(time_ns);
+	memcpy(r.report, report, ELAN_TRACE_REPORT_SIZE);
+
+	return fwrite(&r, sizeof(r), 1, f) == 1 ? 0 : -1;
+}
+
+
+// returns 1 on a record, 0 at the end of the trace and -1 on errors
+static inline int elan_trace_read(FILE *f, int record_size,
+				uint64_t *time_ns, unsigned char *report)
+{
+	struct elan_trace_record r;
+
+	if (fread(&r, sizeof(r), 1, f) != 1)
+		return feof(f) ? 0 : -1;
+	if (record_size > (int)sizeof(r) &&
+	    fseek(f, record_size - sizeof(r), SEEK_CUR) < 0)
+		return -1;
+
+	*time_ns = le64toh(r.time_ns);
+	memcpy(report, r.report, ELAN_TRACE_REPORT_SIZE);
+	return 1;
+}
+
+#endif
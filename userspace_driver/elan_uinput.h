@@ -0,0 +1,276 @@
+/*
+ * Output of the frames of the core as Linux MT protocol type B events,
+ * a frame is one write() to the uinput device or to any other file.
+ *
+ * The last value written is kept for every code and slot, a frame only
+ * has the events which change something, the input core would drop the
+ * others anyway.
+ *
+ * Frames which only move the contacts may be held and merged, the next
+ * write has the latest positions of all of them.
+ */
+
+#ifndef ELAN_UINPUT_H
+#define ELAN_UINPUT_H
+
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/input.h>
+
+#include "../core/elan_core.h"
+
+#define ELAN_UINPUT_MAX_EVENTS 64
+
+#define MT_ID_NULL	(-1)
+#define MT_ID_MIN	0
+#define MT_ID_MAX	65535
+#define MT_ID_SGN	((MT_ID_MAX + 1) >> 1)
+
+// the device's value isn't known, the next one is written
+#define ELAN_UINPUT_UNKNOWN INT_MIN
+
+enum elan_uinput_key {
+	ELAN_KEY_LEFT,
+	ELAN_KEY_TOUCH,
+	ELAN_KEY_TOOLS,
+	ELAN_NUM_KEYS = ELAN_KEY_TOOLS + 5
+};
+
+struct elan_uinput_slot {
+	int tracking_id;
+	int tool;
+	int x, y;
+};
+
+struct elan_uinput {
+	int fd;
+
+	int last_tracking_id;
+	int tracking_ids[ELAN_MAX_CONTACTS];
+
+	// the values written
+	int slot;
+	struct elan_uinput_slot sent[ELAN_MAX_CONTACTS];
+	int keys[ELAN_NUM_KEYS];
+	int abs_x, abs_y;
+
+	// report data
+	int num_events;
+	struct input_event report[ELAN_UINPUT_MAX_EVENTS];
+
+	// the merged frames not written yet
+	int pending;
+	struct elan_frame pending_frame;
+	struct elan_contact pending_contacts[ELAN_MAX_CONTACTS];
+};
+
+// buttons
+static const int elan_key_codes[ELAN_NUM_KEYS] = { BTN_LEFT, BTN_TOUCH,
+			BTN_TOOL_FINGER, BTN_TOOL_DOUBLETAP, BTN_TOOL_TRIPLETAP,
+			BTN_TOOL_QUADTAP, BTN_TOOL_QUINTTAP };
+
+
+// the next frame writes every value
+static inline void elan_uinput_invalidate(struct elan_uinput *u)
+{
+	struct elan_uinput_slot *s;
+
+	u->slot = ELAN_UINPUT_UNKNOWN;
+	for (int i = 0; i < ELAN_MAX_CONTACTS; i++) {
+		s = &u->sent[i];
+		s->tracking_id = s->tool = s->x = s->y = ELAN_UINPUT_UNKNOWN;
+	}
+	for (int i = 0; i < ELAN_NUM_KEYS; i++)
+		u->keys[i] = ELAN_UINPUT_UNKNOWN;
+	u->abs_x = u->abs_y = ELAN_UINPUT_UNKNOWN;
+}
+
+
+static inline void elan_uinput_init(struct elan_uinput *u, int fd)
+{
+	memset(u, 0, sizeof(*u));
+	u->fd = fd;
+	u->last_tracking_id = MT_ID_MIN;
+	for (int i = 0; i < ELAN_MAX_CONTACTS; i++)
+		u->tracking_ids[i] = MT_ID_NULL;
+	elan_uinput_invalidate(u);
+}
+
+
+static inline void elan_uinput_put(struct elan_uinput *u, int type, int code,
+				int value)
+{
+	struct input_event *ev = &u->report[u->num_events++];
+
+	ev->type = type;
+	ev->code = code;
+	ev->value = value;
+}
+
+
+static inline void elan_uinput_update(struct elan_uinput *u, int *sent,
+				int type, int code, int value)
+{
+	if (*sent == value)
+		return;
+	*sent = value;
+	elan_uinput_put(u, type, code, value);
+}
+
+
+// the slot is switched only when one of its values changes
+static inline void elan_uinput_update_slot(struct elan_uinput *u, int slot,
+				int *sent, int code, int value)
+{
+	if (*sent == value)
+		return;
+	if (u->slot != slot) {
+		u->slot = slot;
+		elan_uinput_put(u, EV_ABS, ABS_MT_SLOT, slot);
+	}
+	*sent = value;
+	elan_uinput_put(u, EV_ABS, code, value);
+}
+
+
+// the frame only moves contacts which are down, no contact touches down
+// or is lifted, no tool and no button changes
+static inline int elan_uinput_motion_only(const struct elan_uinput *u,
+				const struct elan_frame *frame)
+{
+	const struct elan_contact *ct;
+
+	if (frame->btn_left != u->keys[ELAN_KEY_LEFT])
+		return 0;
+	for (int i = 0; i < ELAN_MAX_CONTACTS; i++) {
+		if (!(frame->slots & (1U << i)))
+			continue;
+		ct = &frame->contacts[i];
+		if (!ct->touch || u->tracking_ids[i] == MT_ID_NULL ||
+		    u->sent[i].tool != (ct->tool ? MT_TOOL_FINGER : MT_TOOL_PALM))
+			return 0;
+	}
+	return 1;
+}
+
+
+// the frame is merged into the pending one, returns 1 if there was one
+static inline int elan_uinput_hold(struct elan_uinput *u,
+				const struct elan_frame *frame)
+{
+	struct elan_frame *p = &u->pending_frame;
+	int merged = u->pending;
+
+	if (!u->pending)
+		p->slots = 0;
+	// the contacts outside the slots have their last values, the
+	// single touch axes may be taken from them
+	memcpy(u->pending_contacts, frame->contacts, sizeof(u->pending_contacts));
+	p->contacts = u->pending_contacts;
+	p->slots |= frame->slots;
+	p->btn_left = frame->btn_left;
+	p->timestamp = frame->timestamp;
+	u->pending = 1;
+	return merged;
+}
+
+
+static inline ssize_t elan_uinput_emit(struct elan_uinput *u,
+				const struct elan_frame *frame);
+
+// writes the pending frame, returns 0 if there is none
+static inline ssize_t elan_uinput_flush(struct elan_uinput *u)
+{
+	if (!u->pending)
+		return 0;
+	u->pending = 0;
+	return elan_uinput_emit(u, &u->pending_frame);
+}
+
+
+// returns the result of the write, a pending frame is written with it
+static inline ssize_t elan_uinput_emit(struct elan_uinput *u,
+				const struct elan_frame *frame)
+{
+	const struct elan_contact *ct;
+	struct elan_uinput_slot *s;
+	int current_touches = 0;
+	ssize_t ret;
+
+	if (u->pending) {
+		elan_uinput_hold(u, frame);
+		u->pending = 0;
+		frame = &u->pending_frame;
+	}
+
+	u->num_events = 0;
+
+	for (int i = 0; i < ELAN_MAX_CONTACTS; i++) {
+		if (!(frame->slots & (1U << i)))
+			continue;
+		ct = &frame->contacts[i];
+		s = &u->sent[i];
+
+		if (ct->touch && u->tracking_ids[i] == MT_ID_NULL)
+			u->tracking_ids[i] = u->last_tracking_id++ & MT_ID_MAX;
+		if (!ct->touch)
+			u->tracking_ids[i] = MT_ID_NULL;
+
+		elan_uinput_update_slot(u, i, &s->tracking_id, ABS_MT_TRACKING_ID,
+					u->tracking_ids[i]);
+
+		if (u->tracking_ids[i] != MT_ID_NULL) {
+			elan_uinput_update_slot(u, i, &s->tool, ABS_MT_TOOL_TYPE,
+						ct->tool ? MT_TOOL_FINGER : MT_TOOL_PALM);
+			elan_uinput_update_slot(u, i, &s->x, ABS_MT_POSITION_X, ct->x);
+			elan_uinput_update_slot(u, i, &s->y, ABS_MT_POSITION_Y, ct->y);
+		}
+	}
+
+	// a contact missing from a partial frame still touches
+	for (int i = 0; i < ELAN_MAX_CONTACTS; i++)
+		current_touches += u->tracking_ids[i] != MT_ID_NULL;
+
+	elan_uinput_update(u, &u->keys[ELAN_KEY_LEFT], EV_KEY, BTN_LEFT,
+			   frame->btn_left);
+	elan_uinput_update(u, &u->keys[ELAN_KEY_TOUCH], EV_KEY, BTN_TOUCH,
+			   current_touches > 0);
+
+	for (int i = 0; i < 5; i++)
+		elan_uinput_update(u, &u->keys[ELAN_KEY_TOOLS + i], EV_KEY,
+				   elan_key_codes[ELAN_KEY_TOOLS + i],
+				   current_touches == i + 1);
+
+	if (current_touches > 0) {
+		int current_id;
+		int oldest_slot = -1;
+		int old_id = u->last_tracking_id;
+		for (int i = 0; i < ELAN_MAX_CONTACTS; i++) {
+			if (u->tracking_ids[i] == MT_ID_NULL)
+				continue;
+			current_id = u->tracking_ids[i];
+			if ((current_id - old_id) & MT_ID_SGN) {
+				oldest_slot = i;
+				old_id = current_id;
+			}
+		}
+		if (oldest_slot > -1) {
+			elan_uinput_update(u, &u->abs_x, EV_ABS, ABS_X,
+					   frame->contacts[oldest_slot].x);
+			elan_uinput_update(u, &u->abs_y, EV_ABS, ABS_Y,
+					   frame->contacts[oldest_slot].y);
+		}
+	}
+
+	elan_uinput_put(u, EV_MSC, MSC_TIMESTAMP, frame->timestamp);
+	elan_uinput_put(u, EV_SYN, SYN_REPORT, 0);
+
+	ret = write(u->fd, u->report, sizeof(u->report[0]) * u->num_events);
+	// the device may have missed a part of the frame
+	if (ret != (ssize_t)(sizeof(u->report[0]) * u->num_events))
+		elan_uinput_invalidate(u);
+	return ret;
+}
+
+#endif
@@ -3,6 +3,7 @@
 #define _GNU_SOURCE
 
 #include <string.h>
+#include <stddef.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -10,430 +11,443 @@
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <time.h>
-#ifndef __STDC_NO_ATOMICS__
-#include <stdatomic.h>
-#endif
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <linux/netlink.h>
 #include <linux/hidraw.h>
 #include <linux/uinput.h>
 
+#include "../core/elan_core.h"
+#include "elan_uinput.h"
+#include "elan_trace.h"
+#include "elan_stats.h"
+#include "elan_rt.h"
+#include "elan_rdesc.h"
+
 
 #define VIRTUAL_DEV_NAME "VirtualELAN1200"
 #define VIRT_VID 0x04F3
 #define VIRT_PID 0x3022
 #define ELAN_NAME "ELAN1200:00 04F3:3022"
-
-// on my machine 14 ms is minimum, otherwise
-// the delayed state is reported earlier than the next event arrives
-#define DELAY 17
-#define DELAY_NS DELAY * 1000000
-
-#define AREA_TRESHOLD 16
-
-// gcc -o hid_elan1200 hid_elan1200.c -lrt -DMEASURE_TIME
-#ifdef MEASURE_TIME
-static struct timespec start_ts, stop_ts;
-#endif
-
-#define MAX_X 3200
-#define MAX_Y 2198
-#define RESOLUTION 31
-#define MAX_CONTACTS 5
-#define MAX_SCANTIME ((255 << 8) | 255)
-#define MAX_TIMESTAMP_INTERVAL 1000000
+#define ELAN_VID 0x04F3
+#define ELAN_PID 0x3022
+#define VIRTUAL_DEV_TIMEOUT_NSEC 1000000000ULL
 
 #define INPUT_MODE_REPORT_ID 0x3
 #define INPUT_MODE_TOUCHPAD 0x03
 #define LATENCY_MODE_REPORT_ID 0x7
 #define LATENCY_MODE_NORMAL 0x00
+#define LATENCY_MODE_HIGH 0x01
 
-#define MAX_EVENTS 64
+#define MAX_POLL_EVENTS 8
+#define MAX_REPORT_SIZE 64
 
-#define MT_ID_NULL	(-1)
-#define MT_ID_MIN	0
-#define MT_ID_MAX	65535
-#define MT_ID_SGN	((MT_ID_MAX + 1) >> 1)
+// the check of the idle period and the write of the coalesced frames
+// after the core's timers
+#define IDLE_TIMER ELAN_NUM_TIMERS
+#define COALESCE_TIMER (ELAN_NUM_TIMERS + 1)
+#define NUM_TIMERS (ELAN_NUM_TIMERS + 2)
+#define MAX_DEVICES 4
+// the longest hold of the coalesced frames without vsync hints
+#define VSYNC_TIMEOUT_USEC 20000
 
-#define INPUT_SYNC_NDELAY 4000000
+// the multicast group of the uevents sent by the kernel
+#define UEVENT_GROUP_KERNEL 1
+#define UEVENT_BUFFER_SIZE 4096
 
 
-#define ELAN_REPORT_ID 0x04
-#define ELAN_REPORT_SIZE 14
-
-// interrupts
-static volatile sig_atomic_t stop = 0;
-
-static void interrupt_handler(int sig)
-{
-	stop = 1;
-}
-
 // state
-struct contact {
-	int in_report;
-	int x, y;
-	int tool;
-	int touch;
-};
-
-struct elan_usages {
-	int x, y;
-	int tool;
-	int touch;
-	int slot;
-	int num_contacts;
-	int scantime;
-	int btn_left;
-};
-
 struct elan_application {
-	int vfd;
+	struct elan_uinput out;
+	int tfd;
+	// the hidraw device for feature reports, -1 in a replay
+	int fd;
+	const struct elan_layout *layout;
 
-	struct contact hw_state[MAX_CONTACTS];
-	struct contact delayed_state[MAX_CONTACTS];
+	// the time of the report or the timer being handled,
+	// replay drives it from the trace
+	uint64_t now;
 
-	int left_button_state;
-	int num_expected;
-	int num_received;
-	atomic_bool delayed_flag_pending;
-	atomic_bool delayed_flag_running;
-	atomic_bool had_run;
+	struct elan_core core;
 
-	int last_tracking_id;
-	int tracking_ids[MAX_CONTACTS];
+	uint64_t deadline[NUM_TIMERS];
 
-	int area;
+	// read times of the last report and the one before
+	uint64_t report_time;
+	uint64_t prev_report_time;
+	// the time of the last write to the virtual device
+	uint64_t write_time;
+	// the read or the timer deadline the frames are written for, the
+	// latency of a timer doesn't include the hold
+	uint64_t wake_time;
 
-	struct timespec ts;
-	int timestamp;
-	int prev_scantime;
-	int scantime_logical_max;
+	// the device is in the high latency mode since idle_since
+	int idle;
+	uint64_t idle_since;
 };
 
-// timer
-static timer_t timer_id;
-static struct itimerspec ts;
-static struct sigevent se;
-static struct timespec input_sync_ts;
-static struct timespec now_ts;
-
-// report data
-static struct input_event report[MAX_EVENTS];
-
-// buttons
-static int btn_tools[5] = { BTN_TOOL_FINGER, BTN_TOOL_DOUBLETAP, BTN_TOOL_TRIPLETAP,
-			BTN_TOOL_QUADTAP, BTN_TOOL_QUINTTAP };
-
+// a touchpad, the virtual device and the timer outlive the hidraw node
+struct elan_device {
+	// the hidraw node, the fd is -1 while detached
+	char node[32];
+	int fd;
+	int vfd;
+	// the layout the virtual device was created for
+	struct elan_layout layout;
+	struct elan_application app;
+};
 
-static inline unsigned long
-ts_delta_usec(const struct timespec *a, const struct timespec *b)
+// options
+static struct elan_core_params params = {
+	.delay_percentile = ELAN_DELAY_PERCENTILE,
+	.delay_min_us = ELAN_DELAY_MIN_USEC,
+	.delay_max_us = ELAN_DELAY_MAX_USEC,
+	.predict_max = ELAN_PREDICT_MAX_DISTANCE,
+	.smooth_beta = ELAN_SMOOTH_BETA,
+};
+// the options or their copy in the statistics, which may be changed
+static struct elan_core_params *core_params = &params;
+static const char *record_path;
+static const char *replay_path;
+static const char *output_path;
+static int replay_fast;
+static int idle_ms;
+static int coalesce_us;
+static const char *vsync_path;
+// the hints of the display refresh, a byte each
+static int vsync_fd = -1;
+static int realtime;
+static int cpu = -1;
+
+static FILE *record_file;
+static struct elan_stats *stats;
+
+static struct elan_device devices[MAX_DEVICES];
+static int epfd = -1;
+
+
+static uint64_t now_ns(void)
 {
-	struct timespec r;
-	r.tv_sec = a->tv_sec - b->tv_sec;
-	r.tv_nsec = a->tv_nsec - b->tv_nsec;
-	if (r.tv_nsec < 0) {
-		r.tv_sec--;
-		r.tv_nsec += 1000000000;
-	}
-	return (unsigned long)r.tv_sec * 1000000 + r.tv_nsec / 1000;
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
 }
 
-static inline unsigned long
-ts_delta_msec(const struct timespec *a, const struct timespec *b)
+
+static uint64_t app_now(void *ctx)
 {
-	return ts_delta_usec(a, b) / 1000;
+	struct elan_application *app = ctx;
+	return app->now;
 }
 
 
-static int compute_timestamp(struct elan_application *app, int value)
+static uint64_t next_deadline(struct elan_application *app)
 {
-	int delta = value - app->prev_scantime;
-
-	clock_gettime(CLOCK_MONOTONIC_RAW, &now_ts);
-	unsigned long tsdelta = ts_delta_usec(&now_ts, &app->ts);
-
-	app->ts = now_ts;
-
-	if (delta < 0)
-		delta += app->scantime_logical_max;
+	uint64_t next = 0;
 
-	delta *= 100;
-
-	app->prev_scantime = value;
-	
-	if (tsdelta > MAX_TIMESTAMP_INTERVAL)
-		return 0;
-	else
-		return app->timestamp + delta;
+	for (int i = 0; i < NUM_TIMERS; i++) {
+		if (app->deadline[i] && (!next || app->deadline[i] < next))
+			next = app->deadline[i];
+	}
+	return next;
 }
 
 
-static void send_report(struct elan_application *app, int delay) {
-	int j = 0;
-	struct contact *ct;
-	int current_touches = 0;
-	int tool = MT_TOOL_FINGER;
-
-	struct contact *state = delay ? app->delayed_state : app->hw_state;
-
-	for (int i = 0; i < MAX_CONTACTS; i++) {
-		ct = &(state[i]);
-		if (!ct->in_report) {
-			// sometimes the touchpad forgets to report releases
-			// every contact which touches the surface is always
-			// reported otherwise mark it released
-			if (ct->touch)
-				ct->touch = 0;
-			else
-				continue;
-		}
+// the timerfd always holds the earliest of the pending deadlines
+static void rearm_timer(struct elan_application *app)
+{
+	struct itimerspec its;
+	uint64_t next = next_deadline(app);
 
-		report[j].type = EV_ABS;
-		report[j].code = ABS_MT_SLOT;
-		report[j++].value = i;
+	if (app->tfd < 0)
+		return;
 
-		if (ct->touch && app->tracking_ids[i] == MT_ID_NULL)
-			app->tracking_ids[i] = app->last_tracking_id++ & MT_ID_MAX;
-		if (!ct->touch)
-			app->tracking_ids[i] = MT_ID_NULL;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = next / 1000000000;
+	its.it_value.tv_nsec = next % 1000000000;
+	timerfd_settime(app->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
 
-		report[j].type = EV_ABS;
-		report[j].code = ABS_MT_TRACKING_ID;
-		report[j++].value = app->tracking_ids[i];
 
-		if (app->tracking_ids[i] != MT_ID_NULL) {
-			current_touches++;
+// a zero deadline cancels the timer
+static void set_deadline(void *ctx, enum elan_core_timer timer,
+			uint64_t deadline)
+{
+	struct elan_application *app = ctx;
 
-			if (!ct->tool)
-				tool = MT_TOOL_PALM;
-			report[j].type = EV_ABS;
-			report[j].code = ABS_MT_TOOL_TYPE;
-			report[j++].value = tool;
+	if (app->deadline[timer] == deadline)
+		return;
+	app->deadline[timer] = deadline;
+	rearm_timer(app);
+}
 
-			report[j].type = EV_ABS;
-			report[j].code = ABS_MT_POSITION_X;
-			report[j++].value = ct->x;
 
-			report[j].type = EV_ABS;
-			report[j].code = ABS_MT_POSITION_Y;
-			report[j++].value = ct->y;
-		}
+// writes the frame with the frames merged before it, or only those
+static void write_frame(struct elan_application *app,
+			const struct elan_frame *frame)
+{
+	if (frame) {
+		if (app->out.pending)
+			elan_stats_count(stats, ELAN_CNT_FRAMES_COALESCED);
+		elan_uinput_emit(&app->out, frame);
+	} else if (!elan_uinput_flush(&app->out)) {
+		return;
+	}
 
-		ct->in_report = 0;
+	app->write_time = app->now;
+	if (app->deadline[COALESCE_TIMER]) {
+		app->deadline[COALESCE_TIMER] = 0;
+		rearm_timer(app);
 	}
 
-	if (delay)
-		memcpy(app->hw_state, app->delayed_state, sizeof(app->hw_state));
+	if (stats) {
+		elan_stats_count(stats, ELAN_CNT_WRITES);
+		elan_stats_record(stats, ELAN_HIST_LATENCY, now_ns() - app->wake_time);
+	}
+}
 
-	report[j].type = EV_KEY;
-	report[j].code = BTN_LEFT;
-	report[j++].value = app->left_button_state;
 
-	report[j].type = EV_KEY;
-	report[j].code = BTN_TOUCH;
-	report[j++].value = current_touches > 0;
+// frames which only move the contacts are merged until the interval
+// since the last write passes or until the next vsync hint, nothing
+// else is held
+static void emit_frame(void *ctx, const struct elan_frame *frame)
+{
+	struct elan_application *app = ctx;
+	uint64_t interval = (uint64_t)coalesce_us * 1000;
+	uint64_t deadline;
 
-	for (int i = 0; i < 5; i++) {
-		report[j].type = EV_KEY;
-		report[j].code = btn_tools[i];
-		report[j++].value = current_touches == i + 1;
+	if (!coalesce_us || !elan_uinput_motion_only(&app->out, frame)) {
+		write_frame(app, frame);
+		return;
 	}
 
-	if (current_touches > 0) {
-		int current_id;
-		int oldest_slot = -1;
-		int old_id = app->last_tracking_id;
-		for (int i = 0; i < MAX_CONTACTS; i++) {
-			if (app->tracking_ids[i] == MT_ID_NULL)
-				continue;
-			current_id = app->tracking_ids[i];
-			if ((current_id - old_id) & MT_ID_SGN) {
-				oldest_slot = i;
-				old_id = current_id;
-			}
-		}
-		if (oldest_slot > -1) {
-			report[j].type = EV_ABS;
-			report[j].code = ABS_X;
-			report[j++].value = (state[oldest_slot]).x;
-
-			report[j].type = EV_ABS;
-			report[j].code = ABS_Y;
-			report[j++].value = (state[oldest_slot]).y;
-		}
+	if (elan_uinput_hold(&app->out, frame))
+		elan_stats_count(stats, ELAN_CNT_FRAMES_COALESCED);
+	// with the hints the interval is the longest hold
+	deadline = vsync_fd >= 0 ? app->now + interval : app->write_time + interval;
+	if (vsync_fd < 0 && deadline <= app->now) {
+		write_frame(app, NULL);
+	} else if (!app->deadline[COALESCE_TIMER]) {
+		app->deadline[COALESCE_TIMER] = deadline;
+		rearm_timer(app);
 	}
-
-	report[j].type = EV_MSC;
-	report[j].code = MSC_TIMESTAMP;
-	report[j++].value = app->timestamp;
-
-	report[j].type = EV_SYN;
-	report[j++].code = SYN_REPORT;
-
-	write(app->vfd, &report, sizeof(report[0]) * j);
 }
 
 
-void timer_thread(union sigval sig)
+static void observe(void *ctx, enum elan_core_event event, uint64_t value)
 {
-	struct elan_application *app = (struct elan_application*)sig.sival_ptr;
-	atomic_store(&app->delayed_flag_running, 1);
-	if (atomic_exchange(&app->delayed_flag_pending, 0)) {
-		send_report(app, 1);
+	(void)ctx;
+	switch (event) {
+	case ELAN_EVENT_FRAME:
+		elan_stats_count(stats, ELAN_CNT_FRAMES);
+		break;
+	case ELAN_EVENT_RELEASE_DELAYED:
+		elan_stats_count(stats, ELAN_CNT_RELEASES_DELAYED);
+		break;
+	case ELAN_EVENT_RELEASE_SENT:
+		elan_stats_count(stats, ELAN_CNT_RELEASES_SENT);
+		elan_stats_record(stats, ELAN_HIST_HOLD, value);
+		break;
+	case ELAN_EVENT_RELEASE_DROPPED:
+		elan_stats_count(stats, ELAN_CNT_RELEASES_DROPPED);
+		elan_stats_record(stats, ELAN_HIST_HOLD, value);
+		break;
+	case ELAN_EVENT_FRAME_PARTIAL:
+		elan_stats_count(stats, ELAN_CNT_FRAMES_PARTIAL);
+		if (stats)
+			elan_stats_add(&stats->counters[ELAN_CNT_REPORTS_LOST], value);
+		break;
 	}
-	atomic_store(&app->delayed_flag_running, 0);
-#ifdef MEASURE_TIME
-	clock_gettime(CLOCK_MONOTONIC_RAW, &stop_ts);
-	printf("Timer triggered: %lu ms\n", ts_delta_msec(&stop_ts, &start_ts));
-#endif
 }
 
 
-void init_globals(struct elan_application *app) {
-	se.sigev_notify = SIGEV_THREAD;
-	se.sigev_value.sival_ptr = app;
-	se.sigev_notify_function = timer_thread;
-	se.sigev_notify_attributes = NULL;
-
-	ts.it_value.tv_sec = 0;
-	ts.it_value.tv_nsec = 0;
-	ts.it_interval.tv_sec = 0;
-	ts.it_interval.tv_nsec = 0;
-
-	input_sync_ts.tv_nsec = INPUT_SYNC_NDELAY;
+static const struct elan_core_ops core_ops = {
+	.now = app_now,
+	.emit = emit_frame,
+	.arm = set_deadline,
+	.observe = observe,
+};
 
-	timer_create(CLOCK_REALTIME, &se, &timer_id);
 
-	app->left_button_state = 0;
-	app->last_tracking_id = MT_ID_MIN;
-	atomic_init(&app->delayed_flag_pending, 0);
-	atomic_init(&app->delayed_flag_running, 0);
-	app->num_received = 0;
+static int set_feature(int fd, int report_id, int value)
+{
+	unsigned char buf[3] = { report_id, value, 0 };
+	return ioctl(fd, HIDIOCSFEATURE(3), buf);
+}
 
-	app->area = 0;
 
-	clock_gettime(CLOCK_MONOTONIC_RAW, &app->ts);
-	app->timestamp = 0;
-	app->prev_scantime = 0;
-	app->scantime_logical_max = MAX_SCANTIME;
+// the device scans less often while nothing touches it, the residency
+// is counted when it wakes up
+static void set_idle(struct elan_application *app, int idle, uint64_t now)
+{
+	if (set_feature(app->fd, LATENCY_MODE_REPORT_ID,
+			idle ? LATENCY_MODE_HIGH : LATENCY_MODE_NORMAL) < 0) {
+		perror("Unable to set the latency mode");
+		return;
+	}
 
-	for (int i = 0; i < MAX_CONTACTS; i++) {
-		app->hw_state[i].in_report = 0;
-		app->hw_state[i].x = 0;
-		app->hw_state[i].y = 0;
-		app->hw_state[i].tool = 1;
-		app->hw_state[i].touch = 0;
-		app->tracking_ids[i] = MT_ID_NULL;
+	if (idle) {
+		elan_stats_count(stats, ELAN_CNT_LATENCY_HIGH);
+		app->idle_since = now;
+	} else {
+		elan_stats_count(stats, ELAN_CNT_LATENCY_NORMAL);
+		if (stats)
+			elan_stats_add(&stats->counters[ELAN_CNT_IDLE_MS],
+				(now - app->idle_since) / 1000000);
 	}
+	app->idle = idle;
 }
 
 
-void buf_to_usages(unsigned char *buf, struct elan_usages *usages,
-			struct elan_application *app) {
-	int height, width;
-
-	usages->slot = buf[1] >> 4;
-	usages->touch = (buf[1] & 0x0f) == 3;
-	usages->x = ((buf[3] & 0x0f) << 8) | buf[2];
-	usages->y = ((buf[5] & 0x0f) << 8) | buf[4];
-	usages->scantime = (buf[7] << 8) | buf[6];
-	usages->num_contacts = buf[8];
-	usages->tool = (buf[9] >> 1) < 38;
-	usages->btn_left = buf[9] & 0x01;
-
-	// ? = buf[9]
-	// ? = buf[10]
-	// some combined data of the duration of contact
-	// which resets after inactivity,
-	// contact area and clickpad button
+// the check is armed once per period rather than on every report, and
+// nothing is armed while the device is idle
+static void idle_expired(struct elan_application *app, uint64_t now)
+{
+	uint64_t period = (uint64_t)idle_ms * 1000000;
 
-	width = buf[11] & 0x0f;
-	height = buf[11] >> 4;
-	app->area = width * height;
+	if (now - app->report_time >= period)
+		set_idle(app, 1, now);
+	else
+		app->deadline[IDLE_TIMER] = app->report_time + period;
 }
 
 
-static void do_capture(int fd, int vfd) {
-
-	struct elan_usages usages;
-	struct elan_application app;
-	app.vfd = vfd;
-
-	init_globals(&app);
-
-	unsigned char buf[ELAN_REPORT_SIZE];
-	int is_touch;
-	int is_release;
-	int rc;
-
-	while(!stop) {
-		if ((rc = read(fd, buf, sizeof(buf))) < 0 && !stop) {
-			fprintf(stderr, "Error reading the hidraw device file.\n");
-			break;
+static void timer_expired(struct elan_application *app, uint64_t now)
+{
+	app->now = now;
+	for (int i = 0; i < ELAN_NUM_TIMERS; i++) {
+		if (app->deadline[i] && app->deadline[i] <= now) {
+			app->wake_time = app->deadline[i];
+			app->deadline[i] = 0;
+			elan_core_timer(&app->core, i);
 		}
-		// ignore 0x40 event
-		if (buf[0] != ELAN_REPORT_ID || buf[1] == 0x40)
-			continue;
+	}
+	if (app->deadline[IDLE_TIMER] && app->deadline[IDLE_TIMER] <= now) {
+		app->deadline[IDLE_TIMER] = 0;
+		idle_expired(app, now);
+	}
+	if (app->deadline[COALESCE_TIMER] && app->deadline[COALESCE_TIMER] <= now) {
+		app->wake_time = app->deadline[COALESCE_TIMER];
+		app->deadline[COALESCE_TIMER] = 0;
+		write_frame(app, NULL);
+	}
+	rearm_timer(app);
+}
 
-		// ignore irrelevant states if any
-		is_touch = (buf[1] & 0x0f) == 3;
-		is_release = (buf[1] & 0x0f) == 1;
-		if (!is_touch && !is_release)
-			continue;
-		buf_to_usages(buf, &usages, &app);
 
-		if (atomic_exchange(&app.delayed_flag_pending, 0)) {
-			if (usages.num_contacts == 1) {
-				send_report(&app, 1);
-				nanosleep(&input_sync_ts, &input_sync_ts);
-			}
-#ifdef MEASURE_TIME
-			clock_gettime(CLOCK_MONOTONIC_RAW, &stop_ts);
-			printf("Next event arrived: %lu ms\n",
-					ts_delta_msec(&stop_ts, &start_ts));
-#endif
-		} else if (atomic_load(&app.delayed_flag_running)) {
-			nanosleep(&input_sync_ts, &input_sync_ts);
-		}
+void init_globals(struct elan_application *app, int vfd,
+		const struct elan_layout *layout, uint64_t now) {
+	app->now = now;
+	app->layout = layout;
+	elan_core_init(&app->core, &core_ops, app, core_params);
+	if (layout->fields[ELAN_FIELD_SCAN_TIME].size)
+		app->core.scantime_logical_max =
+			layout->fields[ELAN_FIELD_SCAN_TIME].logical_max;
+	app->core.x_max = layout->fields[ELAN_FIELD_X].logical_max;
+	app->core.y_max = layout->fields[ELAN_FIELD_Y].logical_max;
+	elan_uinput_init(&app->out, vfd);
+
+	for (int i = 0; i < NUM_TIMERS; i++)
+		app->deadline[i] = 0;
+
+	app->report_time = 0;
+	app->prev_report_time = 0;
+	app->write_time = 0;
+	app->wake_time = 0;
+	app->idle = 0;
+}
 
-		if (usages.num_contacts) {
-			app.num_expected = usages.num_contacts;
-			app.num_received = 0;
-		}
 
-		app.num_received++;
+static void handle_report(struct elan_application *app, unsigned char *buf,
+			int size, uint64_t now)
+{
+	struct elan_contact_report r;
+
+	if (elan_layout_decode(app->layout, buf, size, &r))
+		return;
+
+	elan_stats_count(stats, ELAN_CNT_REPORTS);
+	app->prev_report_time = app->report_time;
+	app->report_time = app->wake_time = now;
+	if (app->prev_report_time)
+		elan_stats_record(stats, ELAN_HIST_INTERVAL, now - app->prev_report_time);
+
+	app->now = now;
+	elan_core_report(&app->core, &r);
+
+	if (!idle_ms || app->fd < 0)
+		return;
+	// the first touch wakes the device up, after its report
+	if (app->idle)
+		set_idle(app, 0, now);
+	if (!app->deadline[IDLE_TIMER]) {
+		app->deadline[IDLE_TIMER] = now + (uint64_t)idle_ms * 1000000;
+		rearm_timer(app);
+	}
+}
 
-		struct contact *ct = &app.hw_state[usages.slot];
-		ct->in_report = 1;
-		ct->tool = usages.tool;
-		ct->x = usages.x;
-		ct->y = usages.y;
-		ct->touch = usages.touch;
 
-		if (app.num_received < app.num_expected)
-			continue;
+// the event node of the virtual device is there when its input device
+// is, with devtmpfs, otherwise it's waited for
+static int wait_virtual_device(int vfd)
+{
+	char sysname[64], path[PATH_MAX], node[PATH_MAX] = "";
+	struct pollfd pfd;
+	struct dirent *d;
+	uint64_t deadline, now;
+	char buf[4096];
+	DIR *dir;
+	int ret = -1;
+
+	if (ioctl(vfd, UI_GET_SYSNAME(sizeof(sysname)), sysname) < 0)
+		return -1;
 
-		app.left_button_state = usages.btn_left;
-
-		app.timestamp = compute_timestamp(&app, usages.scantime);
-
-		if (usages.num_contacts == 1 && !usages.touch && app.area > AREA_TRESHOLD) {
-			memcpy(app.delayed_state, app.hw_state, sizeof(app.hw_state));
-			ts.it_value.tv_nsec = DELAY_NS;
-			timer_settime(timer_id, 0, &ts, 0);
-			atomic_store(&app.delayed_flag_pending, 1);
-#ifdef MEASURE_TIME
-			printf("Timer started\n");
-			clock_gettime(CLOCK_MONOTONIC_RAW, &start_ts);
-#endif
-		} else {
-			send_report(&app, 0);
+	snprintf(path, sizeof(path), "/sys/devices/virtual/input/%s", sysname);
+	if (!(dir = opendir(path)))
+		return -1;
+	while ((d = readdir(dir))) {
+		if (!strncmp(d->d_name, "event", 5)) {
+			snprintf(node, sizeof(node), "/dev/input/%s", d->d_name);
+			break;
 		}
 	}
+	closedir(dir);
+	if (!node[0])
+		return -1;
+
+	// watched before the check so the creation isn't missed
+	pfd.events = POLLIN;
+	if ((pfd.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+		return -1;
+	if (inotify_add_watch(pfd.fd, "/dev/input", IN_CREATE | IN_ATTRIB) < 0)
+		goto out;
+
+	deadline = now_ns() + VIRTUAL_DEV_TIMEOUT_NSEC;
+	while (access(node, F_OK) < 0) {
+		if ((now = now_ns()) >= deadline)
+			goto out;
+		if (poll(&pfd, 1, (deadline - now) / 1000000 + 1) > 0)
+			while (read(pfd.fd, buf, sizeof(buf)) > 0);
+	}
+	ret = 0;
+out:
+	close(pfd.fd);
+	return ret;
 }
 
 
-static int create_virtual_device() {
+static int create_virtual_device(const struct elan_layout *layout) {
+	const struct elan_field_info *field;
 	int vfd;
 	if ((vfd = open("/dev/uinput", O_WRONLY | O_NONBLOCK)) < 0) {
 		fprintf(stderr, "Error upening uinput device.\n");
@@ -460,26 +474,27 @@ static int create_virtual_device() {
 	int abs_bits[7] = { ABS_X, ABS_Y, ABS_MT_POSITION_X, ABS_MT_POSITION_Y,
 			ABS_MT_SLOT, ABS_MT_TRACKING_ID, ABS_MT_TOOL_TYPE };
 	struct uinput_abs_setup abssetup;
-	abssetup.absinfo.minimum = 0;
 	abssetup.absinfo.value = 0;
 	abssetup.absinfo.flat = 0;
 	abssetup.absinfo.fuzz = 0;
 	for (int i = 0; i < 7; i++) {
 		abssetup.code = abs_bits[i];
+		abssetup.absinfo.minimum = 0;
 		abssetup.absinfo.resolution = 0;
 		switch (abs_bits[i]) {
 		case ABS_MT_POSITION_X:
 		case ABS_X:
-			abssetup.absinfo.maximum = MAX_X;
-			abssetup.absinfo.resolution = RESOLUTION;
-			break;
 		case ABS_MT_POSITION_Y:
 		case ABS_Y:
-			abssetup.absinfo.maximum = MAX_Y;
-			abssetup.absinfo.resolution = RESOLUTION;
+			field = &layout->fields[abs_bits[i] == ABS_X ||
+				abs_bits[i] == ABS_MT_POSITION_X ?
+				ELAN_FIELD_X : ELAN_FIELD_Y];
+			abssetup.absinfo.minimum = field->logical_min;
+			abssetup.absinfo.maximum = field->logical_max;
+			abssetup.absinfo.resolution = field->resolution;
 			break;
 		case ABS_MT_SLOT:
-			abssetup.absinfo.maximum = MAX_CONTACTS - 1;
+			abssetup.absinfo.maximum = ELAN_MAX_CONTACTS - 1;
 			break;
 		case ABS_MT_TOOL_TYPE:
 			abssetup.absinfo.maximum = 2;
@@ -500,123 +515,747 @@ static int create_virtual_device() {
 	ioctl(vfd, UI_DEV_SETUP, &devsetup);
 	ioctl(vfd, UI_DEV_CREATE);
 
-	sleep(1);
+	if (wait_virtual_device(vfd) < 0)
+		fprintf(stderr, "The virtual device node didn't appear.\n");
 
 	return vfd;
 }
 
 
-static const char *direntcmp;
-static int startswith(const struct dirent *dir) {
-	return strncmp(direntcmp, dir->d_name, strlen(direntcmp)) == 0;
+static int set_features(int fd) {
+	int res;
+	res = set_feature(fd, INPUT_MODE_REPORT_ID, INPUT_MODE_TOUCHPAD);
+	if (res < 0)
+		return res;
+	res = set_feature(fd, LATENCY_MODE_REPORT_ID, LATENCY_MODE_NORMAL);
+	if (res < 0)
+		return res;
+	return 0;
 }
 
-static int is_elan(const char *name) {
-	return strncmp(ELAN_NAME, name, strlen(ELAN_NAME)) == 0;
+
+static int epoll_add(int epfd, int fd)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
 }
 
-static int get_src_device(const char *dir, const char *prefix) {
-	char *filename;
-	struct dirent **namelist;
-	int i, ndev, fd;
-	int devnum = -1;
 
-	direntcmp = prefix;
-	ndev = scandir(dir, &namelist, startswith, versionsort);
-	if (ndev <= 0)
-		return -1;
+static struct elan_device *find_device(int fd)
+{
+	for (int i = 0; i < MAX_DEVICES; i++) {
+		if (devices[i].fd >= 0 && devices[i].fd == fd)
+			return &devices[i];
+	}
+	return NULL;
+}
 
-	for (i = 0; i < ndev; i++)
-	{
-		char fname[PATH_MAX];
-		int fd = -1;
-		char hid_name[256] = "???";
 
-		snprintf(fname, sizeof(fname), "%s/%s", dir, namelist[i]->d_name);
+static struct elan_device *find_timer(int tfd)
+{
+	for (int i = 0; i < MAX_DEVICES; i++) {
+		if (devices[i].app.tfd >= 0 && devices[i].app.tfd == tfd)
+			return &devices[i];
+	}
+	return NULL;
+}
 
-		fd = open(fname, O_RDONLY);
-		if (fd < 0)
-			continue;
-		ioctl(fd, HIDIOCGRAWNAME(sizeof(hid_name)), hid_name);
-		close(fd);
 
-		if (!is_elan(hid_name))
-			continue;
+static struct elan_device *find_node(const char *node)
+{
+	for (int i = 0; i < MAX_DEVICES; i++) {
+		if (devices[i].fd >= 0 && !strcmp(devices[i].node, node))
+			return &devices[i];
+	}
+	return NULL;
+}
 
-		char scanstr[64] = "";
-		strcat(strcat(scanstr, prefix), "%d");
-		sscanf(namelist[i]->d_name, scanstr, &devnum);
-		break;
+
+// the HID device of a hidraw node is known from sysfs, no unrelated
+// device is opened
+static int is_elan(const char *node)
+{
+	char path[PATH_MAX], line[256];
+	unsigned int bus, vendor, product;
+	int id = 0, name = 0;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/class/hidraw/%s/device/uevent", node);
+	if (!(f = fopen(path, "re")))
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "HID_ID=%x:%x:%x", &bus, &vendor, &product) == 3)
+			id = vendor == ELAN_VID && product == ELAN_PID;
+		else if (!strncmp(line, "HID_NAME=", 9))
+			name = !strncmp(line + 9, ELAN_NAME, strlen(ELAN_NAME));
 	}
+	fclose(f);
+	return id && name;
+}
 
-	if (devnum < 0)
-		return -1;
 
-	for (i = 0; i < ndev; i++)
-		free(namelist[i]);
+static void close_virtual_device(struct elan_device *dev)
+{
+	if (dev->app.tfd >= 0)
+		close(dev->app.tfd);
+	dev->app.tfd = -1;
+	ioctl(dev->vfd, UI_DEV_DESTROY);
+	close(dev->vfd);
+	dev->vfd = -1;
+}
+
+
+// the layout of the report descriptor, the ELAN1200's if it isn't known
+static void read_layout(int fd, const char *node, struct elan_layout *l)
+{
+	struct hidraw_report_descriptor desc;
+
+	memset(&desc, 0, sizeof(desc));
+	if (ioctl(fd, HIDIOCGRDESCSIZE, &desc.size) < 0 ||
+	    ioctl(fd, HIDIOCGRDESC, &desc) < 0 ||
+	    elan_rdesc_parse(desc.value, desc.size, l) < 0) {
+		fprintf(stderr, "The report descriptor of %s isn't known, "
+			"the ELAN1200 layout is used.\n", node);
+		elan_layout_default(l);
+	}
+}
+
+
+static void attach_device(const char *node)
+{
+	struct elan_device *dev = NULL;
+	struct elan_layout layout;
+	char path[PATH_MAX];
+	uint64_t now;
+	int fd, i;
+
+	if (strlen(node) >= sizeof(dev->node) || find_node(node) || !is_elan(node))
+		return;
+
+	snprintf(path, sizeof(path), "/dev/%s", node);
+	if ((fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0)
+		return;
+
+	if (set_features(fd) < 0) {
+		perror("HIDIOCSFEATURE");
+		goto error;
+	}
+
+	read_layout(fd, node, &layout);
+
+	// a virtual device left by a detached touchpad is reused, so a reset
+	// or a resume doesn't make the desktop re-add the input device
+	for (i = 0; i < MAX_DEVICES && !dev; i++) {
+		if (devices[i].fd < 0 && devices[i].vfd >= 0 &&
+		    !memcmp(&devices[i].layout, &layout, sizeof(layout)))
+			dev = &devices[i];
+	}
+	// or one of another firmware which has gone
+	for (i = 0; i < MAX_DEVICES && !dev; i++) {
+		if (devices[i].fd < 0 && devices[i].vfd >= 0) {
+			dev = &devices[i];
+			close_virtual_device(dev);
+		}
+	}
+	for (i = 0; i < MAX_DEVICES && !dev; i++) {
+		if (devices[i].vfd < 0)
+			dev = &devices[i];
+	}
+	if (!dev) {
+		fprintf(stderr, "Too many devices, %s is ignored.\n", node);
+		goto error;
+	}
+
+	if (dev->vfd < 0) {
+		dev->layout = layout;
+		if ((dev->vfd = create_virtual_device(&dev->layout)) < 0) {
+			perror("Unable to create virtual device");
+			goto error;
+		}
+		dev->app.tfd = timerfd_create(CLOCK_MONOTONIC,
+					TFD_NONBLOCK | TFD_CLOEXEC);
+		if (dev->app.tfd < 0 || epoll_add(epfd, dev->app.tfd) < 0) {
+			perror("Unable to create the timer");
+			goto error_virtual;
+		}
+	}
+
+	if (epoll_add(epfd, fd) < 0) {
+		perror("epoll_ctl");
+		goto error;
+	}
+
+	now = now_ns();
+	init_globals(&dev->app, dev->vfd, &dev->layout, now);
+	dev->app.fd = fd;
+	strcpy(dev->node, node);
+	dev->fd = fd;
+	// a touchpad which is never touched goes idle too
+	if (idle_ms) {
+		dev->app.deadline[IDLE_TIMER] = now + (uint64_t)idle_ms * 1000000;
+		rearm_timer(&dev->app);
+	}
+	fprintf(stderr, "Attached %s.\n", node);
+	return;
+
+error_virtual:
+	close_virtual_device(dev);
+error:
+	close(fd);
+}
+
+
+// the contacts and the button which were down are released
+static void detach_device(struct elan_device *dev)
+{
+	struct elan_contact released[ELAN_MAX_CONTACTS];
+	struct elan_frame frame;
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, dev->fd, NULL);
+	close(dev->fd);
+	dev->fd = -1;
+	fprintf(stderr, "Detached %s.\n", dev->node);
+
+	for (int i = 0; i < NUM_TIMERS; i++)
+		dev->app.deadline[i] = 0;
+	rearm_timer(&dev->app);
+	if (dev->app.idle && stats)
+		elan_stats_add(&stats->counters[ELAN_CNT_IDLE_MS],
+			(now_ns() - dev->app.idle_since) / 1000000);
+	dev->app.fd = -1;
+
+	memset(released, 0, sizeof(released));
+	memset(&frame, 0, sizeof(frame));
+	frame.contacts = released;
+	frame.slots = (1U << ELAN_MAX_CONTACTS) - 1;
+	elan_uinput_emit(&dev->app.out, &frame);
+}
+
 
-	if (asprintf(&filename, "%s/%s%d", dir, prefix, devnum) < 0)
+static void scan_devices(void)
+{
+	struct dirent *d;
+	DIR *dir;
+
+	if (!(dir = opendir("/sys/class/hidraw")))
+		return;
+	while ((d = readdir(dir))) {
+		if (!strncmp(d->d_name, "hidraw", 6))
+			attach_device(d->d_name);
+	}
+	closedir(dir);
+}
+
+
+static int open_uevents(void)
+{
+	struct sockaddr_nl addr;
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    NETLINK_KOBJECT_UEVENT);
+	if (fd < 0)
 		return -1;
 
-	if ((fd = open(filename, O_RDONLY)) < 0) {
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = UEVENT_GROUP_KERNEL;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
 		return -1;
 	}
 	return fd;
 }
 
 
-static int set_features(int fd) {
-	int res;
-	unsigned char buf[2];
-	buf[0] = INPUT_MODE_REPORT_ID;
-	buf[1] = INPUT_MODE_TOUCHPAD;
-	res = ioctl(fd, HIDIOCSFEATURE(3), buf);
-	if (res < 0)
-		return res;
-	buf[0] = LATENCY_MODE_REPORT_ID;
-	buf[1] = LATENCY_MODE_NORMAL;
-	res = ioctl(fd, HIDIOCSFEATURE(3), buf);
-	if (res < 0)
-		return res;
-	return 0;
+// a kernel uevent is "ACTION@DEVPATH" followed by KEY=VALUE strings
+static void handle_uevents(int nfd)
+{
+	char buf[UEVENT_BUFFER_SIZE];
+	const char *action, *subsystem, *devname, *p;
+	struct elan_device *dev;
+	struct sockaddr_nl addr;
+	socklen_t addrlen;
+	ssize_t len;
+
+	for (;;) {
+		addrlen = sizeof(addr);
+		len = recvfrom(nfd, buf, sizeof(buf) - 1, 0,
+			       (struct sockaddr *)&addr, &addrlen);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			// the socket overflowed, the events lost are unknown
+			if (errno == ENOBUFS)
+				scan_devices();
+			break;
+		}
+		// not from the kernel
+		if (addr.nl_pid)
+			continue;
+		buf[len] = 0;
+
+		action = subsystem = devname = NULL;
+		for (p = buf; p < buf + len; p += strlen(p) + 1) {
+			if (!strncmp(p, "ACTION=", 7))
+				action = p + 7;
+			else if (!strncmp(p, "SUBSYSTEM=", 10))
+				subsystem = p + 10;
+			else if (!strncmp(p, "DEVNAME=", 8))
+				devname = p + 8;
+		}
+		if (!action || !subsystem || !devname || strcmp(subsystem, "hidraw"))
+			continue;
+
+		if (!strcmp(action, "add"))
+			attach_device(devname);
+		else if (!strcmp(action, "remove") && (dev = find_node(devname)))
+			detach_device(dev);
+	}
 }
 
 
-static int start_capture() {
-	int fd;
-	if ((fd = get_src_device("/dev", "hidraw")) < 0) {
-		perror("Unable to open hid device");
-		goto error;
+// a hint writes the frames merged since the last one of every device
+static void handle_vsync(void)
+{
+	char buf[64];
+	uint64_t now = now_ns();
+
+	while (read(vsync_fd, buf, sizeof(buf)) > 0);
+
+	for (int i = 0; i < MAX_DEVICES; i++) {
+		if (devices[i].vfd < 0)
+			continue;
+		devices[i].app.now = devices[i].app.wake_time = now;
+		write_frame(&devices[i].app, NULL);
 	}
+}
 
-	int ret;
-	if ((ret = set_features(fd)) < 0) {
-		perror("HIDIOCSFEATURE");
-		goto error;
+
+// the hidraw devices, their delayed release timers, the uevents, the
+// vsync hints and the termination signals are all served from one
+// thread, nothing runs concurrently
+static void do_capture(int sfd, int nfd) {
+	struct epoll_event events[MAX_POLL_EVENTS];
+	unsigned char buf[MAX_REPORT_SIZE];
+	struct signalfd_siginfo si;
+	struct elan_device *dev;
+	uint64_t expirations, now;
+	int stop = 0;
+	int i, n, fd, rc;
+
+	while (!stop) {
+		n = epoll_wait(epfd, events, MAX_POLL_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			fd = events[i].data.fd;
+			if (fd == sfd) {
+				if (read(sfd, &si, sizeof(si)) > 0)
+					stop = 1;
+			} else if (fd == nfd) {
+				handle_uevents(nfd);
+			} else if (fd == vsync_fd) {
+				handle_vsync();
+			} else if ((dev = find_timer(fd))) {
+				if (read(fd, &expirations, sizeof(expirations)) > 0)
+					timer_expired(&dev->app, now_ns());
+			} else if ((dev = find_device(fd))) {
+				// drain every report queued since the wakeup
+				while ((rc = read(fd, buf, sizeof(buf))) > 0) {
+					now = now_ns();
+					if (record_file && rc == ELAN_REPORT_SIZE &&
+					    buf[0] == ELAN_REPORT_ID)
+						elan_trace_write(record_file, now, buf);
+					handle_report(&dev->app, buf, rc, now);
+				}
+				// gone after a reset or a rebind, the uevent
+				// of its return attaches it again
+				if (!rc || (rc < 0 && errno != EAGAIN))
+					detach_device(dev);
+			}
+		}
 	}
+}
 
-	int vfd;
-	if ((vfd = create_virtual_device()) < 0) {
-		perror("Unable to create virtual device");
-		goto error;
+
+static void replay_wait(uint64_t base, uint64_t time)
+{
+	struct timespec t;
+
+	if (replay_fast)
+		return;
+	t.tv_sec = (base + time) / 1000000000;
+	t.tv_nsec = (base + time) % 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR);
+}
+
+
+static void replay_until(struct elan_application *app, uint64_t base,
+			uint64_t time)
+{
+	uint64_t deadline;
+
+	while ((deadline = next_deadline(app)) && deadline <= time) {
+		replay_wait(base, deadline);
+		timer_expired(app, deadline);
 	}
+	replay_wait(base, time);
+	app->now = time;
+}
 
-	struct sigaction int_action = { .sa_handler = interrupt_handler };
-	sigaction(SIGINT, &int_action, 0);
-	sigaction(SIGTERM, &int_action, 0);
 
-	do_capture(fd, vfd);
+// feeds a trace through the same path as the hidraw reports, the
+// timers run on the trace time so the output doesn't depend on speed
+static int do_replay(const char *path, int vfd, const struct elan_layout *layout)
+{
+	struct elan_application app;
+	unsigned char buf[ELAN_REPORT_SIZE];
+	uint64_t time, first = 0, base;
+	int record_size, rc;
+	FILE *f;
 
-	ioctl(vfd, UI_DEV_DESTROY);
+	if (!(f = fopen(path, "rb")))
+		return -1;
+	if ((record_size = elan_trace_read_header(f)) < 0) {
+		fprintf(stderr, "%s is not a trace.\n", path);
+		fclose(f);
+		return -1;
+	}
+
+	app.tfd = app.fd = -1;
+	init_globals(&app, vfd, layout, 0);
+
+	base = now_ns();
+	while ((rc = elan_trace_read(f, record_size, &time, buf)) > 0) {
+		if (!first)
+			first = time;
+		// timestamps start after zero which marks an idle timer
+		replay_until(&app, base, time - first + 1);
+		handle_report(&app, buf, ELAN_TRACE_REPORT_SIZE, app.now);
+	}
+	while ((time = next_deadline(&app)))
+		replay_until(&app, base, time);
+
+	fclose(f);
+	return rc;
+}
+
+
+static int start_replay() {
+	struct elan_layout layout;
+	int vfd, ret;
+
+	// traces have the reports of the ELAN1200
+	elan_layout_default(&layout);
+
+	if (output_path)
+		vfd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	else
+		vfd = create_virtual_device(&layout);
+	if (vfd < 0) {
+		perror("Unable to open the output");
+		return 1;
+	}
+
+	if ((ret = do_replay(replay_path, vfd, &layout)) < 0)
+		perror("Unable to replay the trace");
+
+	if (!output_path)
+		ioctl(vfd, UI_DEV_DESTROY);
 	close(vfd);
+	return ret < 0;
+}
+
+
+// the segment outlives a crash, a restart just reuses it
+static struct elan_stats *open_stats()
+{
+	struct elan_stats *st;
+	int fd;
+
+	if ((fd = shm_open(ELAN_STATS_NAME, O_CREAT | O_RDWR, 0644)) < 0)
+		return NULL;
+	if (ftruncate(fd, sizeof(*st)) < 0) {
+		close(fd);
+		return NULL;
+	}
+	st = mmap(NULL, sizeof(*st), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 	close(fd);
-	return 0;
-error:
-	return 1;
+	if (st == MAP_FAILED)
+		return NULL;
+
+	memset(st, 0, sizeof(*st));
+	st->params = params;
+	st->version = ELAN_STATS_VERSION;
+	st->size = sizeof(*st);
+	atomic_thread_fence(memory_order_release);
+	st->magic = ELAN_STATS_MAGIC;
+	return st;
+}
+
+
+static void close_stats()
+{
+	if (!stats)
+		return;
+	core_params = &params;
+	munmap(stats, sizeof(*stats));
+	shm_unlink(ELAN_STATS_NAME);
+	stats = NULL;
+}
+
+
+// the readiness protocol of systemd services with Type=notify
+static void notify_service(const char *state)
+{
+	const char *path = getenv("NOTIFY_SOCKET");
+	struct sockaddr_un addr;
+	socklen_t len;
+	int fd;
+
+	if (!path || (path[0] != '/' && path[0] != '@') ||
+	    strlen(path) >= sizeof(addr.sun_path))
+		return;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	// an abstract socket
+	if (path[0] == '@')
+		addr.sun_path[0] = 0;
+	len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+
+	if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+		return;
+	sendto(fd, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr *)&addr, len);
+	close(fd);
+}
+
+
+static int start_capture() {
+	sigset_t mask;
+	int sfd, nfd;
+	int ret = 1;
+
+	for (int i = 0; i < MAX_DEVICES; i++)
+		devices[i].fd = devices[i].vfd = devices[i].app.tfd = -1;
+
+	if (record_path) {
+		if (!(record_file = fopen(record_path, "wb")) ||
+		    elan_trace_write_header(record_file) < 0) {
+			perror("Unable to create the trace");
+			return 1;
+		}
+	}
+
+	if (!(stats = open_stats()))
+		perror("Unable to publish statistics");
+	else
+		core_params = &stats->params;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+
+	// the uevents are listened to before the scan so no device
+	// added in between is missed
+	sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	nfd = open_uevents();
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (sfd < 0 || nfd < 0 || epfd < 0 ||
+	    epoll_add(epfd, sfd) < 0 || epoll_add(epfd, nfd) < 0) {
+		perror("Unable to set up the event loop");
+		goto out;
+	}
+
+	// opened for writing too, so it doesn't hang up without writers
+	if (vsync_path) {
+		if ((mkfifo(vsync_path, 0622) < 0 && errno != EEXIST) ||
+		    (vsync_fd = open(vsync_path, O_RDWR | O_NONBLOCK | O_CLOEXEC)) < 0 ||
+		    epoll_add(epfd, vsync_fd) < 0) {
+			perror("Unable to open the vsync hints");
+			goto out;
+		}
+	}
+
+	scan_devices();
+
+	// after everything the event loop uses is mapped
+	if (elan_rt_setup(realtime, cpu) < 0)
+		perror("Unable to set up the real-time mode");
+
+	notify_service("READY=1");
+	do_capture(sfd, nfd);
+	notify_service("STOPPING=1");
+	ret = 0;
+
+out:
+	for (int i = 0; i < MAX_DEVICES; i++) {
+		if (devices[i].fd >= 0)
+			close(devices[i].fd);
+		if (devices[i].vfd >= 0)
+			close_virtual_device(&devices[i]);
+	}
+	if (epfd >= 0)
+		close(epfd);
+	if (nfd >= 0)
+		close(nfd);
+	if (sfd >= 0)
+		close(sfd);
+	if (vsync_fd >= 0)
+		close(vsync_fd);
+	close_stats();
+	if (record_file)
+		fclose(record_file);
+	return ret;
+}
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		"  -p, --delay-percentile N  percentile of re-touch gaps "
+		"to delay releases for (%d)\n"
+		"  -m, --delay-min MS        shortest delay (%d)\n"
+		"  -M, --delay-max MS        longest delay (%d)\n"
+		"  -r, --record FILE         write the touch reports to a trace\n"
+		"  -R, --replay FILE         read the reports from a trace instead "
+		"of the device\n"
+		"  -o, --output FILE         write the replayed events to a file "
+		"instead of a virtual device\n"
+		"  -f, --fast                replay as fast as possible\n"
+		"  -t, --realtime[=PRIO]     run with SCHED_FIFO priority (%d) "
+		"and locked memory\n"
+		"  -c, --cpu N               run on CPU N\n"
+		"  -i, --idle MS             switch the device to the high latency "
+		"mode after MS without touches (off)\n"
+		"  -P, --predict US          extrapolate the positions US ahead "
+		"(off)\n"
+		"  -D, --predict-max N       move a position by N device units "
+		"at most (%d)\n"
+		"  -s, --smooth MHZ          smooth the positions with a minimum "
+		"cutoff of MHZ mHz (off)\n"
+		"  -b, --smooth-beta N       raise the cutoff by N mHz per device "
+		"unit per ms of speed (%d)\n"
+		"  -H, --hysteresis N        keep a position until it changes "
+		"by more than N device units (off)\n"
+		"  -C, --coalesce US         merge the frames which only move "
+		"the contacts for US (off)\n"
+		"  -V, --vsync FIFO          write the merged frames when a byte "
+		"is written to FIFO\n"
+		"                            or after US (%d)\n",
+		name, ELAN_DELAY_PERCENTILE, ELAN_DELAY_MIN_USEC / 1000,
+		ELAN_DELAY_MAX_USEC / 1000, ELAN_RT_PRIORITY,
+		ELAN_PREDICT_MAX_DISTANCE, ELAN_SMOOTH_BETA, VSYNC_TIMEOUT_USEC);
 }
 
 
 int main(int argc, char **argv)
 {
+	static const struct option options[] = {
+		{ "delay-percentile", required_argument, 0, 'p' },
+		{ "delay-min", required_argument, 0, 'm' },
+		{ "delay-max", required_argument, 0, 'M' },
+		{ "record", required_argument, 0, 'r' },
+		{ "replay", required_argument, 0, 'R' },
+		{ "output", required_argument, 0, 'o' },
+		{ "fast", no_argument, 0, 'f' },
+		{ "realtime", optional_argument, 0, 't' },
+		{ "cpu", required_argument, 0, 'c' },
+		{ "idle", required_argument, 0, 'i' },
+		{ "predict", required_argument, 0, 'P' },
+		{ "predict-max", required_argument, 0, 'D' },
+		{ "smooth", required_argument, 0, 's' },
+		{ "smooth-beta", required_argument, 0, 'b' },
+		{ "hysteresis", required_argument, 0, 'H' },
+		{ "coalesce", required_argument, 0, 'C' },
+		{ "vsync", required_argument, 0, 'V' },
+		{ "help", no_argument, 0, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "p:m:M:r:R:o:ft::c:i:P:D:s:b:H:C:V:h", options, NULL)) != -1) {
+		switch (opt) {
+		case 'p':
+			params.delay_percentile = atoi(optarg);
+			break;
+		case 'm':
+			params.delay_min_us = atoi(optarg) * 1000;
+			break;
+		case 'M':
+			params.delay_max_us = atoi(optarg) * 1000;
+			break;
+		case 'r':
+			record_path = optarg;
+			break;
+		case 'R':
+			replay_path = optarg;
+			break;
+		case 'o':
+			output_path = optarg;
+			break;
+		case 'f':
+			replay_fast = 1;
+			break;
+		case 't':
+			realtime = optarg ? atoi(optarg) : ELAN_RT_PRIORITY;
+			break;
+		case 'c':
+			cpu = atoi(optarg);
+			break;
+		case 'i':
+			idle_ms = atoi(optarg);
+			break;
+		case 'P':
+			params.predict_us = atoi(optarg);
+			break;
+		case 'D':
+			params.predict_max = atoi(optarg);
+			break;
+		case 's':
+			params.smooth_cutoff_mhz = atoi(optarg);
+			break;
+		case 'b':
+			params.smooth_beta = atoi(optarg);
+			break;
+		case 'H':
+			params.smooth_hysteresis = atoi(optarg);
+			break;
+		case 'C':
+			coalesce_us = atoi(optarg);
+			break;
+		case 'V':
+			vsync_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (params.delay_percentile < 1 || params.delay_percentile > 100 ||
+	    params.delay_max_us > ELAN_DELAY_MAX_USEC ||
+	    params.delay_min_us > params.delay_max_us ||
+	    realtime < 0 || realtime > 99 || idle_ms < 0 || coalesce_us < 0 ||
+	    (record_path && replay_path)) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (vsync_path && !coalesce_us)
+		coalesce_us = VSYNC_TIMEOUT_USEC;
+
+	if (replay_path)
+		return start_replay();
 	return start_capture();
 }
@@ -1,4 +1,4 @@
-// gcc mirror_elan1200.c
+// gcc -o mirror_elan1200 mirror_elan1200.c
 
 #define _GNU_SOURCE
 
@@ -6,15 +6,21 @@
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <getopt.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <linux/input.h>
 
 #include <linux/uinput.h>
 
 #include <stdio.h>
 
+#include "../core/elan_core.h"
+
 #define DEV_INPUT_EVENT "/dev/input"
 #define EVENT_DEV_NAME "event"
 #define DEV_NAME "ELAN1200:00 04F3:3022 Touchpad"
@@ -27,6 +33,45 @@
 #define LONG(x) ((x)/BITS_PER_LONG)
 #define test_bit(bit, array)	((array[LONG(bit)] >> OFF(bit)) & 1)
 
+// events taken by one read
+#define READ_EVENTS 64
+// a frame grows in steps of this up to the maximum, then it's
+// written in parts
+#define FRAME_EVENTS 64
+#define MAX_FRAME_EVENTS 4096
+// a frame without its SYN_REPORT is written after this
+#define FLUSH_TIMEOUT_MS 100
+
+#define MAX_SLOTS 16
+#define ABS_MT_FIRST ABS_MT_TOUCH_MAJOR
+#define ABS_MT_CNT (ABS_MAX - ABS_MT_FIRST + 1)
+
+struct frame {
+	struct input_event *events;
+	int len;
+	int size;
+};
+
+// what the virtual device has been sent
+struct device_state {
+	int num_slots;
+	int slot;
+	int abs[ABS_CNT];
+	int mt[MAX_SLOTS][ABS_MT_CNT];
+	unsigned long keys[NBITS(KEY_CNT)];
+};
+
+static struct device_state sent;
+static unsigned long absbits[NBITS(ABS_CNT)];
+static unsigned long keybits[NBITS(KEY_CNT)];
+static unsigned long drops;
+
+// a release frame held back by the filter and the slot it ends
+static int filter_ms;
+static struct frame held;
+static int held_slot;
+static unsigned long ghosts;
+
 
 static int is_event_device(const struct dirent *dir) {
 	return strncmp(EVENT_DEV_NAME, dir->d_name, 5) == 0;
@@ -39,7 +84,7 @@ static int is_elan(const char *name) {
 static char* get_src_device() {
 	char *filename;
 	struct dirent **namelist;
-	int i, ndev, devnum;
+	int i, ndev, devnum = -1;
 
 	ndev = scandir(DEV_INPUT_EVENT, &namelist, is_event_device, versionsort);
 	if (ndev <= 0)
@@ -69,6 +114,10 @@ static char* get_src_device() {
 
 	for (i = 0; i < ndev; i++)
 		free(namelist[i]);
+	free(namelist);
+
+	if (devnum < 0)
+		return NULL;
 
 	if (asprintf(&filename, "%s/%s%d",
 		     DEV_INPUT_EVENT, EVENT_DEV_NAME,
@@ -77,53 +126,469 @@ static char* get_src_device() {
 	return filename;
 }
 
-static volatile sig_atomic_t stop = 0;
-
-static void interrupt_handler(int sig)
+static int frame_add(struct frame *f, const struct input_event *ev)
 {
-	stop = 1;
+	struct input_event *events;
+	int size;
+
+	if (f->len == f->size) {
+		size = f->size ? f->size * 2 : FRAME_EVENTS;
+		if (size > MAX_FRAME_EVENTS)
+			return -1;
+		if (!(events = realloc(f->events, size * sizeof(*events))))
+			return -1;
+		f->events = events;
+		f->size = size;
+	}
+	f->events[f->len++] = *ev;
+	return 0;
 }
 
-static int capture_events(int fd, int vfd)
+
+static void frame_put(struct frame *f, int type, int code, int value)
 {
 	struct input_event ev;
-	struct input_event events[64];
-	int report_len = 0;
-	int rd;
-	fd_set rdfs;
 
-	FD_ZERO(&rdfs);
-	FD_SET(fd, &rdfs);
+	memset(&ev, 0, sizeof(ev));
+	ev.type = type;
+	ev.code = code;
+	ev.value = value;
+	frame_add(f, &ev);
+}
+
+
+static void apply_event(struct device_state *st, const struct input_event *ev)
+{
+	if (ev->type == EV_KEY && ev->code < KEY_CNT) {
+		if (ev->value)
+			st->keys[LONG(ev->code)] |= BIT(ev->code);
+		else
+			st->keys[LONG(ev->code)] &= ~BIT(ev->code);
+	} else if (ev->type == EV_ABS && ev->code < ABS_CNT) {
+		if (ev->code == ABS_MT_SLOT)
+			st->slot = ev->value;
+		else if (ev->code >= ABS_MT_FIRST && st->slot >= 0 &&
+			 st->slot < st->num_slots)
+			st->mt[st->slot][ev->code - ABS_MT_FIRST] = ev->value;
+		st->abs[ev->code] = ev->value;
+	}
+}
+
+
+static void frame_flush(struct frame *f, int vfd)
+{
+	if (!f->len)
+		return;
+	for (int i = 0; i < f->len; i++)
+		apply_event(&sent, &f->events[i]);
+	write(vfd, f->events, sizeof(f->events[0]) * f->len);
+	f->len = 0;
+}
+
+
+// the virtual device right after its creation, the values of the
+// source at that moment and no contacts
+static void init_state(int fd)
+{
+	struct input_absinfo ai;
+
+	memset(&sent, 0, sizeof(sent));
+	ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(absbits)), absbits);
+	ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keybits)), keybits);
+
+	for (int code = 0; code < ABS_CNT; code++) {
+		if (test_bit(code, absbits) && !ioctl(fd, EVIOCGABS(code), &ai))
+			sent.abs[code] = ai.value;
+	}
+	if (test_bit(ABS_MT_SLOT, absbits)) {
+		ioctl(fd, EVIOCGABS(ABS_MT_SLOT), &ai);
+		sent.num_slots = ai.maximum + 1 < MAX_SLOTS ? ai.maximum + 1 : MAX_SLOTS;
+		sent.slot = ai.value;
+	}
+	for (int i = 0; i < MAX_SLOTS; i++)
+		sent.mt[i][ABS_MT_TRACKING_ID - ABS_MT_FIRST] = -1;
+}
+
+
+// the slot of the frame being built, it's tracked when it's written
+static void put_slot(struct frame *f, int *cur, int slot)
+{
+	if (*cur != slot)
+		frame_put(f, EV_ABS, ABS_MT_SLOT, slot);
+	*cur = slot;
+}
+
+
+// the device's current state is read and the difference to what the
+// virtual device has is sent, contacts which changed are ended in a
+// frame of their own first
+static void resync(int fd, int vfd, struct frame *f)
+{
+	struct {
+		__u32 code;
+		__s32 values[MAX_SLOTS];
+	} req;
+	int mt[ABS_MT_CNT][MAX_SLOTS];
+	unsigned long keys[NBITS(KEY_CNT)];
+	struct input_absinfo ai;
+	int cur = sent.slot, slot = sent.slot;
+	int code, i, id, value;
+
+	memset(keys, 0, sizeof(keys));
+	ioctl(fd, EVIOCGKEY(sizeof(keys)), keys);
+	for (code = ABS_MT_FIRST; code < ABS_CNT; code++) {
+		if (!test_bit(code, absbits))
+			continue;
+		req.code = code;
+		if (ioctl(fd, EVIOCGMTSLOTS(sizeof(req)), &req) < 0)
+			return;
+		memcpy(mt[code - ABS_MT_FIRST], req.values, sizeof(req.values));
+	}
+	if (test_bit(ABS_MT_SLOT, absbits) && !ioctl(fd, EVIOCGABS(ABS_MT_SLOT), &ai))
+		slot = ai.value;
+
+	f->len = 0;
+	id = ABS_MT_TRACKING_ID - ABS_MT_FIRST;
+	for (i = 0; i < sent.num_slots; i++) {
+		if (sent.mt[i][id] >= 0 && mt[id][i] != sent.mt[i][id]) {
+			put_slot(f, &cur, i);
+			frame_put(f, EV_ABS, ABS_MT_TRACKING_ID, -1);
+		}
+	}
+	if (f->len) {
+		frame_put(f, EV_SYN, SYN_REPORT, 0);
+		frame_flush(f, vfd);
+	}
+
+	for (i = 0; i < sent.num_slots; i++) {
+		if (test_bit(ABS_MT_TRACKING_ID, absbits) &&
+		    mt[id][i] != sent.mt[i][id]) {
+			put_slot(f, &cur, i);
+			frame_put(f, EV_ABS, ABS_MT_TRACKING_ID, mt[id][i]);
+		}
+		for (code = ABS_MT_FIRST; code < ABS_CNT; code++) {
+			if (code == ABS_MT_TRACKING_ID || !test_bit(code, absbits))
+				continue;
+			value = mt[code - ABS_MT_FIRST][i];
+			if (value != sent.mt[i][code - ABS_MT_FIRST]) {
+				put_slot(f, &cur, i);
+				frame_put(f, EV_ABS, code, value);
+			}
+		}
+	}
+	if (test_bit(ABS_MT_SLOT, absbits))
+		put_slot(f, &cur, slot);
+
+	for (code = 0; code < ABS_MT_SLOT; code++) {
+		if (test_bit(code, absbits) && !ioctl(fd, EVIOCGABS(code), &ai) &&
+		    ai.value != sent.abs[code])
+			frame_put(f, EV_ABS, code, ai.value);
+	}
+	for (code = 0; code < KEY_CNT; code++) {
+		if (test_bit(code, keybits) &&
+		    test_bit(code, keys) != test_bit(code, sent.keys))
+			frame_put(f, EV_KEY, code, test_bit(code, keys));
+	}
+
+	if (f->len) {
+		frame_put(f, EV_SYN, SYN_REPORT, 0);
+		frame_flush(f, vfd);
+	}
+}
+
+
+static int last_slot(const struct frame *f, int slot)
+{
+	for (int i = 0; i < f->len; i++) {
+		if (f->events[i].type == EV_ABS && f->events[i].code == ABS_MT_SLOT)
+			slot = f->events[i].value;
+	}
+	return slot;
+}
+
+
+// a frame which ends one contact and drops the two finger tool may be
+// the ghost release, the slot of the contact is returned
+static int ghost_release(const struct frame *f, int slot)
+{
+	const struct input_event *ev;
+	int ended = -1, tool_drop = 0;
+
+	for (int i = 0; i < f->len; i++) {
+		ev = &f->events[i];
+		if (ev->type == EV_KEY && ev->code == BTN_TOOL_DOUBLETAP && !ev->value)
+			tool_drop = 1;
+		if (ev->type != EV_ABS)
+			continue;
+		if (ev->code == ABS_MT_SLOT)
+			slot = ev->value;
+		else if (ev->code == ABS_MT_TRACKING_ID) {
+			if (ev->value < 0 && ended < 0)
+				ended = slot;
+			else
+				return -1;
+		}
+	}
+	return tool_drop ? ended : -1;
+}
+
+
+// the index of the event which starts a contact in the slot
+static int contact_start(const struct frame *f, int slot, int target)
+{
+	const struct input_event *ev;
+
+	for (int i = 0; i < f->len; i++) {
+		ev = &f->events[i];
+		if (ev->type != EV_ABS)
+			continue;
+		if (ev->code == ABS_MT_SLOT)
+			slot = ev->value;
+		else if (ev->code == ABS_MT_TRACKING_ID && ev->value >= 0 &&
+			 slot == target)
+			return i;
+	}
+	return -1;
+}
+
+
+static int is_touch_key(int code)
+{
+	switch (code) {
+	case BTN_TOUCH:
+	case BTN_TOOL_FINGER:
+	case BTN_TOOL_DOUBLETAP:
+	case BTN_TOOL_TRIPLETAP:
+	case BTN_TOOL_QUADTAP:
+	case BTN_TOOL_QUINTTAP:
+		return 1;
+	}
+	return 0;
+}
+
+
+// the contact and the tools stay as they were, the rest of the held
+// frame is still sent
+static void strip_release(struct frame *f)
+{
+	const struct input_event *ev;
+	int len = 0;
+
+	for (int i = 0; i < f->len; i++) {
+		ev = &f->events[i];
+		if (ev->type == EV_ABS && ev->code == ABS_MT_TRACKING_ID)
+			continue;
+		if (ev->type == EV_KEY && is_touch_key(ev->code))
+			continue;
+		f->events[len++] = *ev;
+	}
+	f->len = len;
+}
+
+
+static void arm_filter(int tfd, int ms)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+	timerfd_settime(tfd, 0, &its, NULL);
+}
+
+
+// the release was a real one
+static void send_held(int vfd, int tfd)
+{
+	if (!held.len)
+		return;
+	arm_filter(tfd, 0);
+	frame_flush(&held, vfd);
+}
+
+
+// a complete frame goes through the filter, a release of one of two
+// contacts is held back until the timer and dropped if the contact is
+// back in its slot earlier
+static void filter_frame(struct frame *f, int vfd, int tfd)
+{
+	struct frame tmp;
+	int i;
+
+	if (held.len) {
+		i = contact_start(f, last_slot(&held, sent.slot), held_slot);
+		if (i < 0) {
+			send_held(vfd, tfd);
+			frame_flush(f, vfd);
+			return;
+		}
+		arm_filter(tfd, 0);
+		strip_release(&held);
+		frame_flush(&held, vfd);
+		memmove(&f->events[i], &f->events[i + 1],
+			(f->len - i - 1) * sizeof(f->events[0]));
+		f->len--;
+		frame_flush(f, vfd);
+		ghosts++;
+		return;
+	}
+
+	held_slot = ghost_release(f, sent.slot);
+	if (held_slot < 0) {
+		frame_flush(f, vfd);
+		return;
+	}
+	tmp = held;
+	held = *f;
+	*f = tmp;
+	f->len = 0;
+	arm_filter(tfd, filter_ms);
+}
+
+
+static int epoll_add(int epfd, int fd)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+
+// evdev hands out whole frames, a read takes as many events as fit and
+// they are split into frames here, so a frame costs a wakeup, a read and
+// a write
+static int capture_events(int fd, int vfd)
+{
+	struct input_event buf[READ_EVENTS];
+	struct epoll_event events[3];
+	struct frame frame;
+	struct signalfd_siginfo si;
+	sigset_t mask;
+	int epfd, sfd, tfd = -1;
+	uint64_t expirations;
+	int ret = EXIT_SUCCESS;
+	int stop = 0, dropping = 0;
+	int i, j, n, rd;
+
+	memset(&frame, 0, sizeof(frame));
+	// the source may be touched already
+	init_state(fd);
+	resync(fd, vfd, &frame);
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+
+	sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (filter_ms)
+		tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (sfd < 0 || epfd < 0 || epoll_add(epfd, fd) < 0 ||
+	    epoll_add(epfd, sfd) < 0 ||
+	    (filter_ms && (tfd < 0 || epoll_add(epfd, tfd) < 0))) {
+		perror("Unable to set up the event loop");
+		ret = EXIT_FAILURE;
+		goto out;
+	}
 
 	while (!stop) {
-		select(fd + 1, &rdfs, NULL, NULL, NULL);
-		if (stop)
+		n = epoll_wait(epfd, events, 3, frame.len ? FLUSH_TIMEOUT_MS : -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			ret = EXIT_FAILURE;
 			break;
-		rd = read(fd, &ev, sizeof(struct input_event));
-
-		if (rd < (int) sizeof(struct input_event)) {
-			printf("expected %d bytes, got %d\n",
-				(int) sizeof(struct input_event), rd);
-			perror("\nevtest: error reading");
-			return 1;
+		}
+		if (!n) {
+			send_held(vfd, tfd);
+			frame_flush(&frame, vfd);
 		}
 
-		events[report_len++] = ev;
+		for (i = 0; i < n; i++) {
+			if (events[i].data.fd == sfd) {
+				if (read(sfd, &si, sizeof(si)) > 0)
+					stop = 1;
+				continue;
+			}
+			if (events[i].data.fd == tfd) {
+				if (read(tfd, &expirations, sizeof(expirations)) > 0)
+					send_held(vfd, tfd);
+				continue;
+			}
 
-		// inputs events should be analysed here and
-		// conditionally delayed but is less reliable
-		// than using raw hid data from the device
+			// a short read has taken everything there was
+			do {
+				rd = read(fd, buf, sizeof(buf));
+				if (rd <= 0) {
+					if (rd < 0 && errno == EAGAIN)
+						break;
+					perror("\nevtest: error reading");
+					ret = EXIT_FAILURE;
+					stop = 1;
+					break;
+				}
+
+				for (j = 0; j < rd / (int)sizeof(buf[0]); j++) {
+					// the events up to the next SYN_REPORT are
+					// incomplete, the state is read instead
+					if (buf[j].type == EV_SYN &&
+					    buf[j].code == SYN_DROPPED) {
+						frame.len = 0;
+						// the resync sends a real release
+						held.len = 0;
+						if (tfd >= 0)
+							arm_filter(tfd, 0);
+						dropping = 1;
+						drops++;
+						continue;
+					}
+					if (dropping) {
+						if (buf[j].type == EV_SYN &&
+						    buf[j].code == SYN_REPORT) {
+							dropping = 0;
+							resync(fd, vfd, &frame);
+						}
+						continue;
+					}
 
-		if (ev.type == EV_SYN && ev.code == SYN_REPORT) {
-			write(vfd, &events, sizeof(events[0]) * report_len);
-			report_len = 0;
+					if (frame_add(&frame, &buf[j]) < 0) {
+						send_held(vfd, tfd);
+						frame_flush(&frame, vfd);
+						frame_add(&frame, &buf[j]);
+					}
+					if (buf[j].type != EV_SYN ||
+					    buf[j].code != SYN_REPORT)
+						continue;
+					if (filter_ms)
+						filter_frame(&frame, vfd, tfd);
+					else
+						frame_flush(&frame, vfd);
+				}
+			} while (rd == sizeof(buf));
 		}
 	}
-	
+
+out:
+	if (drops)
+		fprintf(stderr, "Resynchronised after %lu SYN_DROPPED.\n", drops);
+	if (filter_ms)
+		fprintf(stderr, "Dropped %lu ghost releases.\n", ghosts);
+	free(frame.events);
+	free(held.events);
+	if (tfd >= 0)
+		close(tfd);
+	if (epfd >= 0)
+		close(epfd);
+	if (sfd >= 0)
+		close(sfd);
 	ioctl(vfd, UI_DEV_DESTROY);
-   	close(vfd);
+	close(vfd);
 	ioctl(fd, EVIOCGRAB, (void*)0);
-	return EXIT_SUCCESS;
+	return ret;
 }
 
 
@@ -212,8 +677,12 @@ static int do_mirror()
 {
 	int fd;
 	char *filename = get_src_device();
-	
-	if ((fd = open(filename, O_RDONLY)) < 0) {
+
+	if (!filename) {
+		fprintf(stderr, "Unable to find %s.\n", DEV_NAME);
+		return EXIT_FAILURE;
+	}
+	if ((fd = open(filename, O_RDONLY | O_NONBLOCK)) < 0) {
 		if (errno == EACCES && getuid() != 0)
 			fprintf(stderr, "You do not have access to %s. Try "
 					"running as root instead.\n",
@@ -227,9 +696,6 @@ static int do_mirror()
 	if ((vfd = create_virtual_device(fd)) < 0)
 		goto error;
 
-	signal(SIGINT, interrupt_handler);
-	signal(SIGTERM, interrupt_handler);
-
 	free(filename);
 	return capture_events(fd, vfd);
 error:
@@ -239,7 +705,39 @@ error:
 
 
 
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		"  -f, --filter[=MS]  hold releases of one of two contacts back "
+		"for MS (%d)\n"
+		"                     and drop them if the contact returns\n",
+		name, ELAN_DELAY_USEC / 1000);
+}
+
+
 int main (int argc, char **argv)
 {
+	static const struct option options[] = {
+		{ "filter", optional_argument, 0, 'f' },
+		{ "help", no_argument, 0, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "f::h", options, NULL)) != -1) {
+		switch (opt) {
+		case 'f':
+			filter_ms = optarg ? atoi(optarg) : ELAN_DELAY_USEC / 1000;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (filter_ms < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
 	return do_mirror();
 };
@@ -0,0 +1,449 @@
+// gcc -o test_elan1200 test_elan1200.c && ./test_elan1200 [RDESC]
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "../core/elan_core.h"
+#include "elan_uinput.h"
+#include "elan_rdesc.h"
+
+
+#define SCAN_PERIOD_NSEC 8000000ULL
+#define MAX_RDESC_SIZE 4096
+
+// a touch report with the tip switch and the position
+#define RDESC_HEAD \
+	0x05, 0x0d,		/* Usage Page (Digitizer) */ \
+	0x09, 0x05,		/* Usage (Touch Pad) */ \
+	0xa1, 0x01,		/* Collection (Application) */ \
+	0x85, 0x04,		/*  Report ID (4) */ \
+	0x09, 0x42,		/*  Usage (Tip Switch) */ \
+	0x15, 0x00,		/*  Logical Minimum (0) */ \
+	0x25, 0x01,		/*  Logical Maximum (1) */ \
+	0x75, 0x01,		/*  Report Size (1) */ \
+	0x95, 0x01,		/*  Report Count (1) */ \
+	0x81, 0x02,		/*  Input (Data,Var,Abs) */ \
+	0x75, 0x07,		/*  Report Size (7) */ \
+	0x81, 0x03,		/*  Input (Cnst,Var,Abs) */ \
+	0x05, 0x01,		/*  Usage Page (Generic Desktop) */ \
+	0x09, 0x30,		/*  Usage (X) */ \
+	0x09, 0x31,		/*  Usage (Y) */ \
+	0x26, 0x80, 0x0c,	/*  Logical Maximum (3200) */ \
+	0x75, 0x10,		/*  Report Size (16) */ \
+	0x95, 0x02,		/*  Report Count (2) */ \
+	0x81, 0x02		/*  Input (Data,Var,Abs) */
+
+// the button, the palm value in its padding and the contact area
+#define RDESC_VENDOR \
+	0x05, 0x09,		/*  Usage Page (Button) */ \
+	0x09, 0x01,		/*  Usage (Button 1) */ \
+	0x25, 0x01,		/*  Logical Maximum (1) */ \
+	0x75, 0x01,		/*  Report Size (1) */ \
+	0x95, 0x01,		/*  Report Count (1) */ \
+	0x81, 0x02,		/*  Input (Data,Var,Abs) */ \
+	0x75, 0x07,		/*  Report Size (7) */ \
+	0x81, 0x03,		/*  Input (Cnst,Var,Abs) */ \
+	0x06, 0x00, 0xff,	/*  Usage Page (Vendor 0xFF00) */ \
+	0x09, 0xc5,		/*  Usage (0xC5) */ \
+	0x26, 0xff, 0x00,	/*  Logical Maximum (255) */ \
+	0x75, 0x08,		/*  Report Size (8) */ \
+	0x95, 0x02,		/*  Report Count (2) */ \
+	0x81, 0x02		/*  Input (Data,Var,Abs) */
+
+static const uint8_t rdesc_vendor[] = { RDESC_HEAD, RDESC_VENDOR, 0xc0 };
+static const uint8_t rdesc_no_vendor[] = { RDESC_HEAD, 0xc0 };
+
+// a finger, a ghost release and a tap in the area of a report
+#define AREA_FINGER 9
+#define AREA_WIDE 25
+#define AREA_TAP 1
+
+struct test {
+	struct elan_core core;
+	struct elan_uinput out;
+	uint64_t now;
+	uint64_t deadline[ELAN_NUM_TIMERS];
+	int scantime;
+	int fd;
+};
+
+static const struct elan_core_params params = {
+	.delay_percentile = ELAN_DELAY_PERCENTILE,
+	.delay_min_us = ELAN_DELAY_MIN_USEC,
+	.delay_max_us = ELAN_DELAY_MAX_USEC,
+};
+
+static int failed;
+
+
+static uint64_t test_now(void *ctx)
+{
+	struct test *t = ctx;
+	return t->now;
+}
+
+
+static void test_emit(void *ctx, const struct elan_frame *frame)
+{
+	struct test *t = ctx;
+	elan_uinput_emit(&t->out, frame);
+}
+
+
+static void test_arm(void *ctx, enum elan_core_timer timer, uint64_t deadline)
+{
+	struct test *t = ctx;
+	t->deadline[timer] = deadline;
+}
+
+
+static const struct elan_core_ops test_ops = {
+	.now = test_now,
+	.emit = test_emit,
+	.arm = test_arm,
+};
+
+
+// the events go to a memfd, they are read back without moving its offset
+static void test_init(struct test *t)
+{
+	memset(t, 0, sizeof(*t));
+	t->fd = memfd_create("elan1200-test", MFD_CLOEXEC);
+	elan_core_init(&t->core, &test_ops, t, &params);
+	elan_uinput_init(&t->out, t->fd);
+}
+
+
+// the timers run on the test time like in a replay
+static void advance(struct test *t, uint64_t time)
+{
+	int i, next;
+
+	for (;;) {
+		next = -1;
+		for (i = 0; i < ELAN_NUM_TIMERS; i++) {
+			if (t->deadline[i] && t->deadline[i] <= time &&
+			    (next < 0 || t->deadline[i] < t->deadline[next]))
+				next = i;
+		}
+		if (next < 0)
+			break;
+		t->now = t->deadline[next];
+		t->deadline[next] = 0;
+		elan_core_timer(&t->core, next);
+	}
+	t->now = time;
+}
+
+
+// the next scan, its reports come one after another
+static void next_frame(struct test *t)
+{
+	advance(t, t->now + SCAN_PERIOD_NSEC);
+	t->scantime += SCAN_PERIOD_NSEC / 100000;
+}
+
+
+static void report(struct test *t, int slot, int touch, int x,
+			int num_contacts, int area)
+{
+	struct elan_contact_report r = {
+		.x = x, .y = 400, .tool = 1, .touch = touch, .slot = slot,
+		.num_contacts = num_contacts, .scantime = t->scantime,
+		.area = area,
+	};
+
+	elan_core_report(&t->core, &r);
+}
+
+
+// the number of events written with the type and the code, and with the
+// value unless it's ANY_VALUE
+#define ANY_VALUE INT_MIN
+
+static int count_events(struct test *t, int type, int code, int value)
+{
+	struct input_event ev;
+	off_t pos;
+	int n = 0;
+
+	for (pos = 0; pread(t->fd, &ev, sizeof(ev), pos) == sizeof(ev);
+	     pos += sizeof(ev)) {
+		if (ev.type == type && ev.code == code &&
+		    (value == ANY_VALUE || ev.value == value))
+			n++;
+	}
+	return n;
+}
+
+
+static int last_value(struct test *t, int type, int code)
+{
+	struct input_event ev;
+	off_t pos;
+	int value = ANY_VALUE;
+
+	for (pos = 0; pread(t->fd, &ev, sizeof(ev), pos) == sizeof(ev);
+	     pos += sizeof(ev)) {
+		if (ev.type == type && ev.code == code)
+			value = ev.value;
+	}
+	return value;
+}
+
+
+#define CHECK(cond, ...) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s: ", __func__);			\
+		fprintf(stderr, __VA_ARGS__);				\
+		fprintf(stderr, "\n");					\
+		failed = 1;						\
+	}								\
+} while (0)
+
+
+// a contact missing from a partial frame still touches, the touch and
+// the tool keys don't change
+static void test_partial_frame_keys(void)
+{
+	struct test t;
+	int f, i, tool_changes = 0;
+
+	test_init(&t);
+	for (f = 0; f < 4; f++) {
+		next_frame(&t);
+		report(&t, 0, 1, 300 + f, 2, AREA_FINGER);
+		// the next frame makes this one partial
+		if (f != 2)
+			report(&t, 1, 1, 800 + f, 0, AREA_FINGER);
+	}
+	// the last frame is complete, the report of slot 1 ended it
+
+	CHECK(!count_events(&t, EV_KEY, BTN_TOOL_DOUBLETAP, 0),
+	      "BTN_TOOL_DOUBLETAP released with two contacts down");
+	CHECK(!count_events(&t, EV_KEY, BTN_TOOL_FINGER, 1),
+	      "BTN_TOOL_FINGER pressed with two contacts down");
+	// BTN_TOUCH down, then every tool key written once
+	CHECK(count_events(&t, EV_KEY, BTN_TOUCH, ANY_VALUE) == 1,
+	      "BTN_TOUCH changed %d times",
+	      count_events(&t, EV_KEY, BTN_TOUCH, ANY_VALUE));
+	for (i = ELAN_KEY_TOOLS; i < ELAN_NUM_KEYS; i++)
+		tool_changes += count_events(&t, EV_KEY, elan_key_codes[i], ANY_VALUE);
+	CHECK(tool_changes == 5, "the tool keys changed %d times", tool_changes);
+
+	close(t.fd);
+}
+
+
+// the touchpad reports a lift of one of two close fingers with a wide
+// area and both fingers again on the next scan, the lift is dropped
+static void test_ghost_release_dropped(void)
+{
+	struct test t;
+	int f;
+
+	test_init(&t);
+	for (f = 0; f < 3; f++) {
+		next_frame(&t);
+		report(&t, 0, 1, 300 + f, 2, AREA_FINGER);
+		report(&t, 1, 1, 500 + f, 0, AREA_FINGER);
+	}
+	next_frame(&t);
+	report(&t, 0, 0, 303, 1, AREA_WIDE);
+	CHECK(t.deadline[ELAN_TIMER_RELEASE], "the release isn't delayed");
+
+	next_frame(&t);
+	report(&t, 0, 1, 304, 2, AREA_FINGER);
+	report(&t, 1, 1, 504, 0, AREA_FINGER);
+	advance(&t, t.now + ELAN_DELAY_MAX_USEC * 1000ULL);
+
+	CHECK(!count_events(&t, EV_ABS, ABS_MT_TRACKING_ID, MT_ID_NULL),
+	      "a contact is lifted");
+	CHECK(!count_events(&t, EV_KEY, BTN_TOOL_DOUBLETAP, 0),
+	      "BTN_TOOL_DOUBLETAP released");
+	CHECK(last_value(&t, EV_ABS, ABS_MT_POSITION_X) == 504,
+	      "the position after the ghost release isn't written");
+
+	close(t.fd);
+}
+
+
+// a real lift with a wide area is held for the delay, then sent, a tap
+// is sent right away
+static void test_real_release_sent(void)
+{
+	struct test t;
+	uint64_t released, deadline;
+	int f;
+
+	test_init(&t);
+	for (f = 0; f < 3; f++) {
+		next_frame(&t);
+		report(&t, 0, 1, 300 + f, 1, AREA_FINGER);
+	}
+	next_frame(&t);
+	released = t.now;
+	report(&t, 0, 0, 303, 1, AREA_WIDE);
+	deadline = t.deadline[ELAN_TIMER_RELEASE];
+	CHECK(deadline >= released + ELAN_DELAY_MIN_USEC * 1000ULL &&
+	      deadline <= released + ELAN_DELAY_MAX_USEC * 1000ULL,
+	      "the release is held for %lu us",
+	      (unsigned long)((deadline - released) / 1000));
+	CHECK(!count_events(&t, EV_ABS, ABS_MT_TRACKING_ID, MT_ID_NULL),
+	      "the release is sent before the delay");
+
+	// nothing touches the surface anymore
+	advance(&t, deadline);
+	CHECK(count_events(&t, EV_ABS, ABS_MT_TRACKING_ID, MT_ID_NULL) == 1,
+	      "the release isn't sent after the delay");
+	CHECK(last_value(&t, EV_KEY, BTN_TOUCH) == 0, "BTN_TOUCH is still down");
+
+	next_frame(&t);
+	report(&t, 0, 1, 300, 1, AREA_FINGER);
+	next_frame(&t);
+	report(&t, 0, 0, 300, 1, AREA_TAP);
+	CHECK(count_events(&t, EV_ABS, ABS_MT_TRACKING_ID, MT_ID_NULL) == 2,
+	      "the lift of a tap isn't sent right away");
+
+	close(t.fd);
+}
+
+
+// held motion is written once with the latest positions, a lift is
+// written at once together with the motion held before it
+static void test_coalesced_motion(void)
+{
+	struct elan_contact contacts[ELAN_MAX_CONTACTS];
+	struct elan_frame frame = { .contacts = contacts, .slots = 3 };
+	struct test t;
+	int x;
+
+	test_init(&t);
+	memset(contacts, 0, sizeof(contacts));
+	contacts[0] = (struct elan_contact){ .x = 300, .y = 400, .tool = 1, .touch = 1 };
+	contacts[1] = (struct elan_contact){ .x = 500, .y = 400, .tool = 1, .touch = 1 };
+	elan_uinput_emit(&t.out, &frame);
+
+	for (x = 301; x <= 303; x++) {
+		contacts[0].x = x;
+		contacts[1].x = x + 200;
+		CHECK(elan_uinput_motion_only(&t.out, &frame),
+		      "a move isn't motion only");
+		elan_uinput_hold(&t.out, &frame);
+	}
+	CHECK(count_events(&t, EV_SYN, SYN_REPORT, 0) == 1,
+	      "a held frame is written");
+	CHECK(elan_uinput_flush(&t.out) > 0, "nothing is flushed");
+	CHECK(count_events(&t, EV_SYN, SYN_REPORT, 0) == 2,
+	      "the held frames take %d writes",
+	      count_events(&t, EV_SYN, SYN_REPORT, 0) - 1);
+	CHECK(!count_events(&t, EV_ABS, ABS_MT_POSITION_X, 301) &&
+	      !count_events(&t, EV_ABS, ABS_MT_POSITION_X, 302),
+	      "an older position is written");
+	CHECK(count_events(&t, EV_ABS, ABS_MT_POSITION_X, 303) &&
+	      count_events(&t, EV_ABS, ABS_MT_POSITION_X, 503),
+	      "the latest positions aren't written");
+	CHECK(!elan_uinput_flush(&t.out), "the flush is written twice");
+
+	// slot 1 moves, then slot 0 is lifted
+	frame.slots = 2;
+	contacts[1].x = 504;
+	elan_uinput_hold(&t.out, &frame);
+	frame.slots = 1;
+	contacts[0].touch = 0;
+	CHECK(!elan_uinput_motion_only(&t.out, &frame), "a lift is motion only");
+	elan_uinput_emit(&t.out, &frame);
+	CHECK(count_events(&t, EV_SYN, SYN_REPORT, 0) == 3,
+	      "the lift isn't written with the held motion");
+	CHECK(count_events(&t, EV_ABS, ABS_MT_TRACKING_ID, MT_ID_NULL) == 1 &&
+	      last_value(&t, EV_ABS, ABS_MT_POSITION_X) == 504,
+	      "the lift or the held motion is missing");
+	CHECK(last_value(&t, EV_KEY, BTN_TOOL_FINGER) == 1,
+	      "BTN_TOOL_FINGER isn't pressed after the lift");
+
+	close(t.fd);
+}
+
+
+// the ghost release filter needs the palm value and the contact area,
+// a descriptor without them isn't taken for a touchpad of this kind
+static void test_rdesc_vendor_fields(void)
+{
+	struct elan_layout l;
+
+	CHECK(elan_rdesc_parse(rdesc_no_vendor, sizeof(rdesc_no_vendor), &l) < 0,
+	      "a descriptor without the vendor fields is accepted");
+
+	CHECK(!elan_rdesc_parse(rdesc_vendor, sizeof(rdesc_vendor), &l),
+	      "a descriptor with the vendor fields is rejected");
+	CHECK(l.fields[ELAN_FIELD_PALM].offset == 41 &&
+	      l.fields[ELAN_FIELD_PALM].size == 7,
+	      "the palm value is at %d, %d bits",
+	      l.fields[ELAN_FIELD_PALM].offset, l.fields[ELAN_FIELD_PALM].size);
+	CHECK(l.fields[ELAN_FIELD_AREA].offset == 56 &&
+	      l.fields[ELAN_FIELD_AREA].size == 8,
+	      "the contact area is at %d, %d bits",
+	      l.fields[ELAN_FIELD_AREA].offset, l.fields[ELAN_FIELD_AREA].size);
+}
+
+
+// a descriptor dumped from a touchpad, e.g. from
+// /sys/bus/hid/devices/0018:04F3:3022.*/report_descriptor, has the
+// layout of the ELAN1200 the driver was written for
+static void test_rdesc_file(const char *path)
+{
+	static const char *names[ELAN_NUM_FIELDS] = {
+		"confidence", "tip", "contact id", "x", "y", "scan time",
+		"contact count", "button", "palm", "area",
+	};
+	uint8_t desc[MAX_RDESC_SIZE];
+	struct elan_layout l, expected;
+	const struct elan_field_info *f, *e;
+	int fd, size, i;
+
+	if ((fd = open(path, O_RDONLY)) < 0 ||
+	    (size = read(fd, desc, sizeof(desc))) <= 0) {
+		perror(path);
+		failed = 1;
+		return;
+	}
+	close(fd);
+
+	elan_layout_default(&expected);
+	if (elan_rdesc_parse(desc, size, &l) < 0) {
+		CHECK(0, "%s isn't a known touch report", path);
+		return;
+	}
+	CHECK(l.report_id == expected.report_id &&
+	      l.report_size == expected.report_size,
+	      "report %d of %d bytes", l.report_id, l.report_size);
+	for (i = 0; i < ELAN_NUM_FIELDS; i++) {
+		f = &l.fields[i];
+		e = &expected.fields[i];
+		CHECK(f->offset == e->offset && f->size == e->size,
+		      "%s at %d, %d bits instead of %d, %d bits", names[i],
+		      f->offset, f->size, e->offset, e->size);
+	}
+}
+
+
+int main(int argc, char **argv)
+{
+	test_partial_frame_keys();
+	test_ghost_release_dropped();
+	test_real_release_sent();
+	test_coalesced_motion();
+	test_rdesc_vendor_fields();
+	if (argc > 1)
+		test_rdesc_file(argv[1]);
+	if (failed)
+		return 1;
+	printf("ok\n");
+	return 0;
+}
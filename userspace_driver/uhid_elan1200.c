@@ -0,0 +1,827 @@
+// gcc -o uhid_elan1200 uhid_elan1200.c
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include <linux/uhid.h>
+#include <linux/input.h>
+
+#include "elan_trace.h"
+
+
+// the simulated device looks like the real one to both drivers
+#define ELAN_NAME "ELAN1200:00 04F3:3022"
+#define ELAN_VID 0x04F3
+#define ELAN_PID 0x3022
+#define ELAN_REPORT_ID 0x04
+#define ELAN_REPORT_SIZE 14
+
+#define INPUT_MODE_REPORT_ID 0x3
+#define CONTACT_MAX_REPORT_ID 0x5
+#define CERTIFICATION_REPORT_ID 0x6
+#define LATENCY_MODE_REPORT_ID 0x7
+#define CERTIFICATION_SIZE 256
+
+// the output devices of the kernel module and the userspace drivers
+static const char *output_names[] = { "FilteredELAN1200", "VirtualELAN1200" };
+#define NUM_OUTPUT_NAMES (sizeof(output_names) / sizeof(output_names[0]))
+
+// the userspace drivers set the virtual device up after it appears
+#define SETTLE_MS 2000
+// the delayed release of the last frame has to come out
+#define DRAIN_MS 200
+// between the contact reports of one frame
+#define REPORT_SPACING_NS 200000ULL
+#define SCAN_PERIOD_MS 8
+
+// a finger in buf[9], the drivers treat values from 38 up as a palm
+#define FINGER_VENDOR 10
+#define PALM_VENDOR 60
+#define AREA_FINGER 0x22
+#define AREA_WIDE 0x55
+#define AREA_TAP 0x11
+
+#define MAX_EVENTS 64
+
+
+// a reconstruction of the Precision Touchpad descriptor of the device,
+// the touch report has the layout both drivers decode
+static const uint8_t elan_rdesc[] = {
+	0x05, 0x0D,		// Usage Page (Digitizer)
+	0x09, 0x05,		// Usage (Touch Pad)
+	0xA1, 0x01,		// Collection (Application)
+	0x85, ELAN_REPORT_ID,	//   Report ID
+	0x09, 0x22,		//   Usage (Finger)
+	0xA1, 0x02,		//   Collection (Logical)
+	0x15, 0x00,		//     Logical Minimum (0)
+	0x25, 0x01,		//     Logical Maximum (1)
+	0x09, 0x47,		//     Usage (Confidence)
+	0x09, 0x42,		//     Usage (Tip Switch)
+	0x75, 0x01,		//     Report Size (1)
+	0x95, 0x02,		//     Report Count (2)
+	0x81, 0x02,		//     Input (Data,Var,Abs)
+	0x81, 0x03,		//     Input (Const,Var,Abs)
+	0x25, 0x0F,		//     Logical Maximum (15)
+	0x09, 0x51,		//     Usage (Contact Identifier)
+	0x75, 0x04,		//     Report Size (4)
+	0x95, 0x01,		//     Report Count (1)
+	0x81, 0x02,		//     Input (Data,Var,Abs)
+	0x05, 0x01,		//     Usage Page (Generic Desktop)
+	0x75, 0x10,		//     Report Size (16)
+	0x55, 0x0E,		//     Unit Exponent (-2)
+	0x65, 0x11,		//     Unit (cm)
+	0x35, 0x00,		//     Physical Minimum (0)
+	0x26, 0x80, 0x0C,	//     Logical Maximum (3200)
+	0x46, 0x08, 0x04,	//     Physical Maximum (1032)
+	0x09, 0x30,		//     Usage (X)
+	0x81, 0x02,		//     Input (Data,Var,Abs)
+	0x26, 0x96, 0x08,	//     Logical Maximum (2198)
+	0x46, 0xC5, 0x02,	//     Physical Maximum (709)
+	0x09, 0x31,		//     Usage (Y)
+	0x81, 0x02,		//     Input (Data,Var,Abs)
+	0xC0,			//   End Collection
+	0x05, 0x0D,		//   Usage Page (Digitizer)
+	0x55, 0x0C,		//   Unit Exponent (-4)
+	0x66, 0x01, 0x10,	//   Unit (s)
+	0x47, 0xFF, 0xFF, 0x00, 0x00,	// Physical Maximum (65535)
+	0x27, 0xFF, 0xFF, 0x00, 0x00,	// Logical Maximum (65535)
+	0x09, 0x56,		//   Usage (Scan Time)
+	0x81, 0x02,		//   Input (Data,Var,Abs)
+	0x55, 0x00,		//   Unit Exponent (0)
+	0x65, 0x00,		//   Unit (None)
+	0x35, 0x00,		//   Physical Minimum (0)
+	0x45, 0x00,		//   Physical Maximum (0)
+	0x25, 0x7F,		//   Logical Maximum (127)
+	0x09, 0x54,		//   Usage (Contact Count)
+	0x75, 0x08,		//   Report Size (8)
+	0x81, 0x02,		//   Input (Data,Var,Abs)
+	0x05, 0x09,		//   Usage Page (Button)
+	0x25, 0x01,		//   Logical Maximum (1)
+	0x09, 0x01,		//   Usage (Button 1)
+	0x75, 0x01,		//   Report Size (1)
+	0x81, 0x02,		//   Input (Data,Var,Abs)
+	0x95, 0x07,		//   Report Count (7)
+	0x81, 0x03,		//   Input (Const,Var,Abs)
+	0x26, 0xFF, 0x00,	//   Logical Maximum (255)
+	0x09, 0xC5,		//   Usage (0xC5), the contact area in the second byte
+	0x75, 0x08,		//   Report Size (8)
+	0x95, 0x02,		//   Report Count (2)
+	0x81, 0x02,		//   Input (Data,Var,Abs)
+	0x81, 0x03,		//   Input (Const,Var,Abs)
+	0x05, 0x0D,		//   Usage Page (Digitizer)
+	0x85, CONTACT_MAX_REPORT_ID,	// Report ID
+	0x25, 0x0F,		//   Logical Maximum (15)
+	0x09, 0x55,		//   Usage (Contact Count Maximum)
+	0x09, 0x59,		//   Usage (Pad Type)
+	0x75, 0x04,		//   Report Size (4)
+	0x95, 0x02,		//   Report Count (2)
+	0xB1, 0x02,		//   Feature (Data,Var,Abs)
+	0x85, LATENCY_MODE_REPORT_ID,	// Report ID
+	0x25, 0x01,		//   Logical Maximum (1)
+	0x09, 0x60,		//   Usage (Latency Mode)
+	0x75, 0x01,		//   Report Size (1)
+	0x95, 0x01,		//   Report Count (1)
+	0xB1, 0x02,		//   Feature (Data,Var,Abs)
+	0x95, 0x07,		//   Report Count (7)
+	0xB1, 0x03,		//   Feature (Const,Var,Abs)
+	0x06, 0x00, 0xFF,	//   Usage Page (Vendor 0xFF00)
+	0x85, CERTIFICATION_REPORT_ID,	// Report ID
+	0x26, 0xFF, 0x00,	//   Logical Maximum (255)
+	0x09, 0xC5,		//   Usage (0xC5), the Windows 8 certification blob
+	0x75, 0x08,		//   Report Size (8)
+	0x96, 0x00, 0x01,	//   Report Count (256)
+	0xB1, 0x02,		//   Feature (Data,Var,Abs)
+	0xC0,			// End Collection
+	0x05, 0x0D,		// Usage Page (Digitizer)
+	0x09, 0x0E,		// Usage (Device Configuration)
+	0xA1, 0x01,		// Collection (Application)
+	0x85, INPUT_MODE_REPORT_ID,	// Report ID
+	0x09, 0x22,		//   Usage (Finger)
+	0xA1, 0x02,		//   Collection (Logical)
+	0x09, 0x52,		//   Usage (Input Mode)
+	0x15, 0x00,		//     Logical Minimum (0)
+	0x25, 0x0A,		//     Logical Maximum (10)
+	0x75, 0x08,		//     Report Size (8)
+	0x95, 0x01,		//     Report Count (1)
+	0xB1, 0x02,		//     Feature (Data,Var,Abs)
+	0xC0,			//   End Collection
+	0xC0,			// End Collection
+};
+
+struct sim_report {
+	uint64_t time;
+	uint8_t data[ELAN_REPORT_SIZE];
+};
+
+struct sim_contact {
+	int slot;
+	int touch;
+	int x, y;
+	int area;
+};
+
+// the reports to play, times start from zero
+struct script {
+	struct sim_report *reports;
+	int num_reports;
+	int size;
+	uint64_t time;
+	int scantime;
+};
+
+struct sim {
+	int ufd;
+	int efd;
+
+	uint8_t input_mode;
+	uint8_t latency_mode;
+
+	// injection times of the last report of every frame, the events
+	// of the output device are matched against them
+	uint64_t *frame_times;
+	uint64_t *latencies;
+	int num_frames;
+	int num_matched;
+	int next_match;
+	int expected;
+	int received;
+};
+
+static const char *scenario = "ghost";
+static const char *trace_path;
+static const char *rdesc_path;
+static const char *output_name;
+static int repeat = 1;
+static int wait_seconds = 10;
+
+static volatile sig_atomic_t stop;
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+
+static void interrupt_handler(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+
+static int script_add(struct script *s, uint64_t time, const uint8_t *data)
+{
+	struct sim_report *r;
+
+	if (s->num_reports == s->size) {
+		s->size = s->size ? s->size * 2 : 256;
+		r = realloc(s->reports, s->size * sizeof(*r));
+		if (!r)
+			return -1;
+		s->reports = r;
+	}
+	r = &s->reports[s->num_reports++];
+	r->time = time;
+	memcpy(r->data, data, ELAN_REPORT_SIZE);
+	return 0;
+}
+
+
+// one frame is a report per contact, the first one has the count
+static int add_frame(struct script *s, int dt_ms, const struct sim_contact *c,
+			int n, int btn, int vendor)
+{
+	uint8_t buf[ELAN_REPORT_SIZE];
+	int i;
+
+	s->time += dt_ms * 1000000ULL;
+	s->scantime = (s->scantime + dt_ms * 10) & 0xffff;
+
+	for (i = 0; i < n; i++) {
+		memset(buf, 0, sizeof(buf));
+		buf[0] = ELAN_REPORT_ID;
+		// confidence and tip switch
+		buf[1] = (c[i].slot << 4) | (c[i].touch ? 3 : 1);
+		buf[2] = c[i].x & 0xff;
+		buf[3] = (c[i].x >> 8) & 0x0f;
+		buf[4] = c[i].y & 0xff;
+		buf[5] = (c[i].y >> 8) & 0x0f;
+		buf[6] = s->scantime & 0xff;
+		buf[7] = s->scantime >> 8;
+		buf[8] = i ? 0 : n;
+		buf[9] = (vendor << 1) | btn;
+		buf[11] = c[i].area ? c[i].area : AREA_FINGER;
+		if (script_add(s, s->time + i * REPORT_SPACING_NS, buf) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+
+static int add_contact(struct script *s, int dt_ms, int slot, int touch,
+			int x, int y, int area, int btn)
+{
+	struct sim_contact c = { slot, touch, x, y, area };
+	return add_frame(s, dt_ms, &c, 1, btn, FINGER_VENDOR);
+}
+
+
+static int add_pair(struct script *s, int dt_ms, int touch0, int x0, int y0,
+			int touch1, int x1, int y1)
+{
+	struct sim_contact c[2] = {
+		{ 0, touch0, x0, y0, 0 },
+		{ 1, touch1, x1, y1, 0 },
+	};
+	return add_frame(s, dt_ms, c, 2, 0, FINGER_VENDOR);
+}
+
+
+static int scenario_tap(struct script *s)
+{
+	int i, err = 0;
+
+	for (i = 0; i < 4; i++)
+		err |= add_contact(s, i ? SCAN_PERIOD_MS : 200, 0, 1, 1500, 1000, AREA_TAP, 0);
+	err |= add_contact(s, SCAN_PERIOD_MS, 0, 0, 1500, 1000, AREA_TAP, 0);
+
+	// a click with the button under the finger
+	for (i = 0; i < 6; i++)
+		err |= add_contact(s, i ? SCAN_PERIOD_MS : 200, 2, 1, 700, 1800, 0, 1);
+	err |= add_contact(s, SCAN_PERIOD_MS, 2, 0, 700, 1800, AREA_TAP, 0);
+
+	// a palm resting on the edge
+	for (i = 0; i < 4; i++) {
+		struct sim_contact palm = { 1, 1, 3000, 1500, 0x99 };
+		err |= add_frame(s, i ? SCAN_PERIOD_MS : 200, &palm, 1, 0, PALM_VENDOR);
+	}
+	err |= add_contact(s, SCAN_PERIOD_MS, 1, 0, 3000, 1500, AREA_TAP, 0);
+	return err;
+}
+
+
+static int scenario_scroll(struct script *s)
+{
+	int i, err = 0;
+
+	for (i = 0; i < 40; i++)
+		err |= add_pair(s, i ? SCAN_PERIOD_MS : 200, 1, 1200, 600 + i * 20,
+				1, 1500, 600 + i * 20);
+	err |= add_pair(s, SCAN_PERIOD_MS, 0, 1200, 1400, 0, 1500, 1400);
+	return err;
+}
+
+
+// the fingers get close, the second contact is released, the first
+// one is released as well and both are back in the next scan
+static int scenario_ghost(struct script *s)
+{
+	int i, err = 0;
+
+	for (i = 0; i < 10; i++)
+		err |= add_pair(s, i ? SCAN_PERIOD_MS : 200, 1, 1000 + i * 5, 1000,
+				1, 1300 + i * 5, 1000);
+	err |= add_pair(s, SCAN_PERIOD_MS, 1, 1060, 1000, 0, 1360, 1000);
+	for (i = 0; i < 5; i++)
+		err |= add_contact(s, SCAN_PERIOD_MS, 0, 1, 1100 + i * 5, 1000, 0, 0);
+	err |= add_contact(s, SCAN_PERIOD_MS, 0, 0, 1125, 1000, AREA_WIDE, 0);
+	for (i = 0; i < 8; i++)
+		err |= add_pair(s, SCAN_PERIOD_MS, 1, 1130 + i * 5, 1000 + i,
+				1, 1430 + i * 5, 1000);
+	err |= add_pair(s, SCAN_PERIOD_MS, 0, 1200, 1010, 0, 1500, 1000);
+	return err;
+}
+
+
+static int load_trace(struct script *s, const char *path)
+{
+	uint8_t buf[ELAN_REPORT_SIZE];
+	uint64_t time, first = 0;
+	int record_size, rc;
+	FILE *f;
+
+	if (!(f = fopen(path, "rb")))
+		return -1;
+	if ((record_size = elan_trace_read_header(f)) < 0) {
+		fprintf(stderr, "%s is not a trace.\n", path);
+		fclose(f);
+		return -1;
+	}
+	while ((rc = elan_trace_read(f, record_size, &time, buf)) > 0) {
+		if (!first)
+			first = time;
+		if (script_add(s, s->time + time - first, buf) < 0) {
+			rc = -1;
+			break;
+		}
+	}
+	// the next repetition starts after a pause
+	if (s->num_reports)
+		s->time = s->reports[s->num_reports - 1].time + 200000000ULL;
+	fclose(f);
+	return rc;
+}
+
+
+static int build_script(struct script *s)
+{
+	int i, rc = 0;
+
+	for (i = 0; i < repeat && !rc; i++) {
+		if (trace_path)
+			rc = load_trace(s, trace_path);
+		else if (!strcmp(scenario, "ghost"))
+			rc = scenario_ghost(s);
+		else if (!strcmp(scenario, "scroll"))
+			rc = scenario_scroll(s);
+		else if (!strcmp(scenario, "tap"))
+			rc = scenario_tap(s);
+		else {
+			fprintf(stderr, "Unknown scenario %s.\n", scenario);
+			return -1;
+		}
+	}
+	return rc;
+}
+
+
+static int uhid_write(int fd, const struct uhid_event *ev)
+{
+	return write(fd, ev, sizeof(*ev)) == sizeof(*ev) ? 0 : -1;
+}
+
+
+static int uhid_create(int fd, const uint8_t *rdesc, size_t size)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	strcpy((char *)ev.u.create2.name, ELAN_NAME);
+	strcpy((char *)ev.u.create2.phys, "uhid_elan1200");
+	memcpy(ev.u.create2.rd_data, rdesc, size);
+	ev.u.create2.rd_size = size;
+	ev.u.create2.bus = BUS_I2C;
+	ev.u.create2.vendor = ELAN_VID;
+	ev.u.create2.product = ELAN_PID;
+	return uhid_write(fd, &ev);
+}
+
+
+static void uhid_destroy(int fd)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_DESTROY;
+	uhid_write(fd, &ev);
+}
+
+
+// answers the feature requests of the drivers like the device does
+static void get_report(struct sim *sim, const struct uhid_get_report_req *req)
+{
+	struct uhid_event ev;
+	uint8_t *data = ev.u.get_report_reply.data;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_GET_REPORT_REPLY;
+	ev.u.get_report_reply.id = req->id;
+	data[0] = req->rnum;
+
+	switch (req->rnum) {
+	case INPUT_MODE_REPORT_ID:
+		data[1] = sim->input_mode;
+		ev.u.get_report_reply.size = 2;
+		break;
+	case CONTACT_MAX_REPORT_ID:
+		// five contacts, a clickpad
+		data[1] = 0x05;
+		ev.u.get_report_reply.size = 2;
+		break;
+	case LATENCY_MODE_REPORT_ID:
+		data[1] = sim->latency_mode;
+		ev.u.get_report_reply.size = 2;
+		break;
+	case CERTIFICATION_REPORT_ID:
+		ev.u.get_report_reply.size = CERTIFICATION_SIZE + 1;
+		break;
+	default:
+		ev.u.get_report_reply.err = EIO;
+		break;
+	}
+	uhid_write(sim->ufd, &ev);
+}
+
+
+static void set_report(struct sim *sim, const struct uhid_set_report_req *req)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_SET_REPORT_REPLY;
+	ev.u.set_report_reply.id = req->id;
+
+	if (req->size < 2) {
+		ev.u.set_report_reply.err = EIO;
+	} else if (req->rnum == INPUT_MODE_REPORT_ID) {
+		sim->input_mode = req->data[1];
+	} else if (req->rnum == LATENCY_MODE_REPORT_ID) {
+		sim->latency_mode = req->data[1];
+	} else {
+		ev.u.set_report_reply.err = EIO;
+	}
+	uhid_write(sim->ufd, &ev);
+}
+
+
+static void handle_uhid(struct sim *sim)
+{
+	struct uhid_event ev;
+
+	if (read(sim->ufd, &ev, sizeof(ev)) <= 0)
+		return;
+
+	switch (ev.type) {
+	case UHID_GET_REPORT:
+		get_report(sim, &ev.u.get_report);
+		break;
+	case UHID_SET_REPORT:
+		set_report(sim, &ev.u.set_report);
+		break;
+	default:
+		break;
+	}
+}
+
+
+// a frame of the output device is matched to the latest injected
+// frame, the frames it skipped were merged or dropped by the filter
+static void handle_events(struct sim *sim)
+{
+	struct input_event ev[MAX_EVENTS];
+	uint64_t time;
+	int i, k, n;
+
+	while ((n = read(sim->efd, ev, sizeof(ev))) > 0) {
+		for (i = 0; i < n / (int)sizeof(ev[0]); i++) {
+			if (ev[i].type != EV_SYN || ev[i].code != SYN_REPORT)
+				continue;
+			// the events have microseconds, allow for the truncation
+			time = ev[i].input_event_sec * 1000000000ULL +
+				ev[i].input_event_usec * 1000ULL + 999;
+			for (k = -1; sim->next_match < sim->num_frames &&
+			     sim->frame_times[sim->next_match] <= time; sim->next_match++)
+				k = sim->next_match;
+			if (k < 0)
+				continue;
+			time -= 999;
+			sim->latencies[sim->num_matched++] =
+				time > sim->frame_times[k] ? time - sim->frame_times[k] : 0;
+		}
+	}
+}
+
+
+// serves the requests and reads the output device until the time
+static void serve_until(struct sim *sim, uint64_t until)
+{
+	struct pollfd fds[2];
+	struct timespec ts;
+	uint64_t now;
+	int n = 1;
+
+	fds[0].fd = sim->ufd;
+	fds[0].events = POLLIN;
+	if (sim->efd >= 0) {
+		fds[1].fd = sim->efd;
+		fds[1].events = POLLIN;
+		n = 2;
+	}
+
+	while (!stop && (now = now_ns()) < until) {
+		ts.tv_sec = (until - now) / 1000000000;
+		ts.tv_nsec = (until - now) % 1000000000;
+		if (ppoll(fds, n, &ts, NULL) <= 0)
+			continue;
+		if (fds[0].revents & POLLIN)
+			handle_uhid(sim);
+		if (n > 1 && fds[1].revents & POLLIN)
+			handle_events(sim);
+	}
+}
+
+
+static void inject(struct sim *sim, const uint8_t *data)
+{
+	struct uhid_event ev;
+	uint64_t time;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_INPUT2;
+	ev.u.input2.size = ELAN_REPORT_SIZE;
+	memcpy(ev.u.input2.data, data, ELAN_REPORT_SIZE);
+
+	time = now_ns();
+	if (uhid_write(sim->ufd, &ev) < 0) {
+		perror("UHID_INPUT2");
+		return;
+	}
+
+	// the frame is complete with its last contact report
+	if ((data[1] & 0x0f) != 3 && (data[1] & 0x0f) != 1)
+		return;
+	if (data[8]) {
+		sim->expected = data[8];
+		sim->received = 0;
+	}
+	if (++sim->received == sim->expected)
+		sim->frame_times[sim->num_frames++] = time;
+}
+
+
+static int is_output(const char *name)
+{
+	int i;
+
+	if (output_name)
+		return !strcmp(output_name, name);
+	for (i = 0; i < (int)NUM_OUTPUT_NAMES; i++) {
+		if (!strcmp(output_names[i], name))
+			return 1;
+	}
+	return 0;
+}
+
+
+static int open_output(void)
+{
+	struct dirent **namelist;
+	char path[PATH_MAX];
+	char name[256];
+	int clock = CLOCK_MONOTONIC;
+	int i, n, fd = -1;
+
+	n = scandir("/dev/input", &namelist, NULL, versionsort);
+	for (i = 0; i < n; i++) {
+		if (fd < 0 && !strncmp(namelist[i]->d_name, "event", 5)) {
+			snprintf(path, sizeof(path), "/dev/input/%s", namelist[i]->d_name);
+			if ((fd = open(path, O_RDONLY | O_NONBLOCK)) >= 0) {
+				memset(name, 0, sizeof(name));
+				ioctl(fd, EVIOCGNAME(sizeof(name) - 1), name);
+				if (is_output(name)) {
+					printf("measuring %s (%s)\n", name, path);
+				} else {
+					close(fd);
+					fd = -1;
+				}
+			}
+		}
+		free(namelist[i]);
+	}
+	if (n > 0)
+		free(namelist);
+
+	if (fd >= 0)
+		ioctl(fd, EVIOCSCLOCKID, &clock);
+	return fd;
+}
+
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+static void print_latencies(struct sim *sim)
+{
+	static const double percentiles[] = { 50, 90, 99, 99.9 };
+	uint64_t sum = 0;
+	int i, n = sim->num_matched;
+
+	printf("frames injected %d, output frames matched %d\n",
+		sim->num_frames, n);
+	if (!n)
+		return;
+
+	qsort(sim->latencies, n, sizeof(sim->latencies[0]), compare_u64);
+	for (i = 0; i < n; i++)
+		sum += sim->latencies[i];
+
+	printf("%10s %10s %10s %10s %10s %10s\n", "us mean", "p50", "p90",
+		"p99", "p99.9", "max");
+	printf("%10.1f", sum / n / 1000.0);
+	for (i = 0; i < 4; i++)
+		printf(" %10.1f", sim->latencies[(int)((n - 1) * percentiles[i] / 100)] / 1000.0);
+	printf(" %10.1f\n", sim->latencies[n - 1] / 1000.0);
+}
+
+
+static int load_rdesc(const char *path, uint8_t *rdesc)
+{
+	int fd, size;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	size = read(fd, rdesc, HID_MAX_DESCRIPTOR_SIZE);
+	close(fd);
+	return size;
+}
+
+
+static int simulate(struct script *s)
+{
+	static uint8_t rdesc[HID_MAX_DESCRIPTOR_SIZE];
+	struct sim sim;
+	uint64_t base, deadline;
+	int size = sizeof(elan_rdesc);
+	int i, ret = 1;
+
+	memset(&sim, 0, sizeof(sim));
+	sim.efd = -1;
+	sim.frame_times = calloc(s->num_reports + 1, sizeof(uint64_t));
+	sim.latencies = calloc(s->num_reports + 1, sizeof(uint64_t));
+	if (!sim.frame_times || !sim.latencies)
+		goto out;
+
+	if (rdesc_path) {
+		if ((size = load_rdesc(rdesc_path, rdesc)) <= 0) {
+			perror("Unable to read the report descriptor");
+			goto out;
+		}
+	} else {
+		memcpy(rdesc, elan_rdesc, size);
+	}
+
+	if ((sim.ufd = open("/dev/uhid", O_RDWR | O_CLOEXEC)) < 0) {
+		perror("Unable to open /dev/uhid");
+		goto out;
+	}
+	if (uhid_create(sim.ufd, rdesc, size) < 0) {
+		perror("UHID_CREATE2");
+		goto out_close;
+	}
+
+	// a driver is loaded or started while the device is served
+	deadline = now_ns() + wait_seconds * 1000000000ULL;
+	while (!stop && (sim.efd = open_output()) < 0 && now_ns() < deadline)
+		serve_until(&sim, now_ns() + 10000000ULL);
+	if (sim.efd < 0) {
+		if (!stop)
+			fprintf(stderr, "No output device appeared, start a driver.\n");
+		goto out_destroy;
+	}
+	serve_until(&sim, now_ns() + SETTLE_MS * 1000000ULL);
+	handle_events(&sim);
+
+	base = now_ns();
+	for (i = 0; i < s->num_reports && !stop; i++) {
+		serve_until(&sim, base + s->reports[i].time);
+		inject(&sim, s->reports[i].data);
+	}
+	serve_until(&sim, now_ns() + DRAIN_MS * 1000000ULL);
+
+	print_latencies(&sim);
+	ret = 0;
+
+	close(sim.efd);
+out_destroy:
+	uhid_destroy(sim.ufd);
+out_close:
+	close(sim.ufd);
+out:
+	free(sim.frame_times);
+	free(sim.latencies);
+	return ret;
+}
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		"  -s, --scenario NAME  ghost, scroll or tap (ghost)\n"
+		"  -t, --trace FILE     play a trace recorded by hid_elan1200\n"
+		"  -n, --repeat N       play it N times (1)\n"
+		"  -d, --device NAME    the output device to measure "
+		"(FilteredELAN1200 or VirtualELAN1200)\n"
+		"  -w, --wait SECONDS   how long to wait for the output device (10)\n"
+		"      --rdesc FILE     the report descriptor to use instead of "
+		"the built-in one\n",
+		name);
+}
+
+
+int main(int argc, char **argv)
+{
+	static const struct option options[] = {
+		{ "scenario", required_argument, 0, 's' },
+		{ "trace", required_argument, 0, 't' },
+		{ "repeat", required_argument, 0, 'n' },
+		{ "device", required_argument, 0, 'd' },
+		{ "wait", required_argument, 0, 'w' },
+		{ "rdesc", required_argument, 0, 'D' },
+		{ "help", no_argument, 0, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+	struct script script;
+	int opt, ret;
+
+	while ((opt = getopt_long(argc, argv, "s:t:n:d:w:h", options, NULL)) != -1) {
+		switch (opt) {
+		case 's':
+			scenario = optarg;
+			break;
+		case 't':
+			trace_path = optarg;
+			break;
+		case 'n':
+			repeat = atoi(optarg);
+			break;
+		case 'd':
+			output_name = optarg;
+			break;
+		case 'w':
+			wait_seconds = atoi(optarg);
+			break;
+		case 'D':
+			rdesc_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (repeat < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	memset(&script, 0, sizeof(script));
+	if (build_script(&script) < 0) {
+		perror("Unable to build the script");
+		return 1;
+	}
+
+	signal(SIGINT, interrupt_handler);
+	signal(SIGTERM, interrupt_handler);
+
+	ret = simulate(&script);
+	free(script.reports);
+	return ret;
+}